@@ -17,6 +17,8 @@
 
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
 #include "linux/usb.h"
 #include <sound/initval.h>
 
@@ -35,9 +37,6 @@ static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP; /* Enable this card
 #define DRIVER_NAME "snd-usb-sinn7"
 #define CARD_NAME "Status 24|96"
 
-/* Timeout is set to a high value, could probably be reduced. Need more tests */
-#define USB_TIMEOUT 1000
-
 module_param_array(index, int, NULL, 0444);
 MODULE_PARM_DESC(index, "Index value for " CARD_NAME " soundcard.");
 module_param_array(id, charp, NULL, 0444);
@@ -46,6 +45,7 @@ module_param_array(enable, bool, NULL, 0444);
 MODULE_PARM_DESC(enable, "Enable " CARD_NAME " soundcard.");
 
 static DEFINE_MUTEX(register_mutex);
+static struct sinn7_chip *chips[SNDRV_CARDS]; /* by regidx, protected by register_mutex */
 
 struct sinn7_vendor_quirk {
 	const char *device_name;
@@ -88,6 +88,9 @@ static int sinn7_chip_create(struct usb_interface *intf,
 	chip = card->private_data;
 	chip->dev = device;
 	chip->card = card;
+	chip->regidx = idx;
+	/* Each card gets a cpu of its own (as long as there are enough), close to the usb controller */
+	chip->cpu = cpumask_local_spread(idx, dev_to_node(&intf->dev));
 
 	*rchip = chip;
 	return 0;
@@ -126,12 +129,14 @@ static int sinn7_chip_probe(struct usb_interface *intf,
 	return_value = usb_set_interface(device, 0, 1);
 	if (return_value != 0) {
 	  dev_err(&device->dev, "can't set interface 0 for " CARD_NAME " device.\n");
+	  kfree(usb_msg_buffer);
 	  return -EIO;
 	}
 	
 	return_value = usb_set_interface(device, 1, 1);
 	if (return_value != 0) {
 	  dev_err(&device->dev, "can't set interface 1 for " CARD_NAME " device.\n");
+	  kfree(usb_msg_buffer);
 	  return -EIO;
 	}
 
@@ -173,13 +178,14 @@ static int sinn7_chip_probe(struct usb_interface *intf,
 	/* halt the endpoints */
 	return_value = usb_control_msg(device, usb_sndctrlpipe(device, 0), 0x01, 0x02, 0x0, 0x86, usb_msg_buffer, 0, USB_TIMEOUT);
 	return_value = usb_control_msg(device, usb_sndctrlpipe(device, 0), 0x01, 0x02, 0x0, 0x05, usb_msg_buffer, 0, USB_TIMEOUT);
+	kfree(usb_msg_buffer);
 	
-	/* check whether the card is already registered */
+	/* Every device takes the first enabled slot which isn't taken by another one */
 	chip = NULL;
 	mutex_lock(&register_mutex);
 
 	for (i = 0; i < SNDRV_CARDS; i++) {
-		if (enable[i]) {
+		if (enable[i] && !chips[i]) {
 			break;
 		}
 	}
@@ -206,9 +212,16 @@ static int sinn7_chip_probe(struct usb_interface *intf,
 		goto err_chip_destroy;
 	}
 
+	chips[i] = chip;
 	mutex_unlock(&register_mutex);
 
 	usb_set_intfdata(intf, chip);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+	/* The driver core creates them through dev_groups since 5.5, before the uevent */
+	if (sysfs_create_group(&intf->dev.kobj, &sinn7_pcm_attr_group))
+		dev_warn(&device->dev, "cannot create the sysfs attributes\n");
+#endif
 	return 0;
 
 err_chip_destroy:
@@ -222,6 +235,7 @@ static void sinn7_chip_disconnect(struct usb_interface *intf)
 {
 	struct sinn7_chip *chip;
 	struct snd_card *card;
+	int regidx;
 
 	chip = usb_get_intfdata(intf);
 	if (!chip) {
@@ -229,12 +243,23 @@ static void sinn7_chip_disconnect(struct usb_interface *intf)
 	}
 
 	card = chip->card;
+	regidx = chip->regidx;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+	sysfs_remove_group(&intf->dev.kobj, &sinn7_pcm_attr_group);
+#endif
 
 	/* Make sure that the userspace cannot create new request */
 	snd_card_disconnect(card);
 
 	sinn7_pcm_abort(chip);
 	snd_card_free_when_closed(card);
+
+	/* Released last, so a new device can't take the index of this card
+	 * while it's torn down. The chip may be freed already.
+	 */
+	mutex_lock(&register_mutex);
+	chips[regidx] = NULL;
+	mutex_unlock(&register_mutex);
 }
 
 static const struct usb_device_id device_table[] = {
@@ -254,6 +279,9 @@ static struct usb_driver sinn7_usb_driver = {
 	.probe = sinn7_chip_probe,
 	.disconnect = sinn7_chip_disconnect,
 	.id_table = device_table,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	.dev_groups = sinn7_pcm_attr_groups,
+#endif
 };
 
 module_usb_driver(sinn7_usb_driver);
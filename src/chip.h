@@ -21,11 +21,16 @@
 #include <linux/usb.h>
 #include <sound/core.h>
 
+/* Timeout is set to a high value, could probably be reduced. Need more tests */
+#define USB_TIMEOUT 1000
+
 struct pcm_runtime;
 
 struct sinn7_chip {
 	struct usb_device *dev;
 	struct snd_card *card;
 	struct pcm_runtime *pcm;
+	int regidx; /* slot in the index/id/enable parameters */
+	int cpu; /* preferred cpu of the card's work, spread over the cards */
 };
 #endif /* SINN7_CHIP_H */
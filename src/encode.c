@@ -0,0 +1,437 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/* The conversion of PCM frames into the device bitstream and back. This file
+ * doesn't depend on the rest of the driver and also builds in userspace (see
+ * the bench target in the Makefile).
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#endif
+
+#include "encode.h"
+
+/* Builds the eight device bytes for the sample byte b. The device wants one
+ * byte per bit (0x0 or 0x1), most significant bit first.
+ */
+#define SINN7_BITS(b) { ((b) >> 7) & 1, ((b) >> 6) & 1, ((b) >> 5) & 1, ((b) >> 4) & 1, \
+			((b) >> 3) & 1, ((b) >> 2) & 1, ((b) >> 1) & 1, (b) & 1 }
+#define SINN7_BITS_4(b)  SINN7_BITS(b), SINN7_BITS((b) + 1), SINN7_BITS((b) + 2), SINN7_BITS((b) + 3)
+#define SINN7_BITS_16(b) SINN7_BITS_4(b), SINN7_BITS_4((b) + 4), SINN7_BITS_4((b) + 8), SINN7_BITS_4((b) + 12)
+#define SINN7_BITS_64(b) SINN7_BITS_16(b), SINN7_BITS_16((b) + 16), SINN7_BITS_16((b) + 32), SINN7_BITS_16((b) + 48)
+
+/* Lookup table which expands a whole sample byte into its device bytes at once */
+static const u8 sinn7_bit_table[256][8] __aligned(8) = {
+	SINN7_BITS_64(0), SINN7_BITS_64(64), SINN7_BITS_64(128), SINN7_BITS_64(192)
+};
+
+/* Writes the 8 device bytes of one sample byte. The constant size memcpy
+ * compiles to a single 64 bit load/store pair.
+ */
+static inline void sinn7_encode_byte(u8 *outBuffer, const u8 byte)
+{
+	memcpy(outBuffer, sinn7_bit_table[byte], 8);
+}
+
+static unsigned int sinn7_scalar_expand(u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int i;
+	
+	for (i = 0; i < len; i++)
+		sinn7_encode_byte(out + i * 8, in[i]);
+	
+	return len;
+}
+
+/* Packs the lowest bits of 8 device bytes into a sample byte. The multiplication
+ * moves device byte i to bit 63 - i, no two partial products overlap, so there
+ * are no carries and the top byte is the result.
+ */
+static inline u8 sinn7_decode_byte(const u8 *inBuffer)
+{
+	const u64 bits = get_unaligned_le64(inBuffer) & 0x0101010101010101ULL;
+	
+	return (bits * 0x8040201008040201ULL) >> 56;
+}
+
+static unsigned int sinn7_scalar_pack(u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int i;
+	
+	for (i = 0; i < len; i++)
+		out[i] = sinn7_decode_byte(in + i * 8);
+	
+	return len;
+}
+
+/* The fallback, if no vector unit is available (or usable at the moment) */
+const struct sinn7_encoder sinn7_encoder_scalar = {
+	.name = "scalar",
+	.expand = sinn7_scalar_expand,
+	.pack = sinn7_scalar_pack,
+};
+
+/* All encoders built for this architecture, the preferred first */
+const struct sinn7_encoder *const sinn7_encoders[] = {
+#ifdef CONFIG_X86
+#ifdef SINN7_AS_AVX2
+	&sinn7_encoder_avx2,
+#endif
+	&sinn7_encoder_sse2,
+#endif
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+	&sinn7_encoder_neon,
+#endif
+	&sinn7_encoder_scalar,
+	NULL
+};
+
+bool sinn7_encoder_usable(const struct sinn7_encoder *encoder)
+{
+	return !encoder->usable || encoder->usable();
+}
+
+const struct sinn7_encoder *sinn7_encoder_select(void)
+{
+	int i;
+	
+	for (i = 0; sinn7_encoders[i]; i++) {
+		if (sinn7_encoder_usable(sinn7_encoders[i]))
+			return sinn7_encoders[i];
+	}
+	
+	return &sinn7_encoder_scalar;
+}
+
+const struct sinn7_encoder *sinn7_encoder_begin(const struct sinn7_encoder *encoder)
+{
+	if (encoder->begin && !encoder->begin())
+		return &sinn7_encoder_scalar; /* The vector unit can't be used in this context */
+	
+	return encoder;
+}
+
+void sinn7_encoder_end(const struct sinn7_encoder *encoder)
+{
+	if (encoder->end)
+		encoder->end();
+}
+
+/* Expands len wire bytes, the encoder does the bulk and the table the rest */
+static inline void sinn7_expand(const struct sinn7_encoder *encoder, u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int done = encoder->expand(out, in, len);
+	
+	sinn7_scalar_expand(out + done * 8, in + done, len - done);
+}
+
+/* Packs len sample bytes, the counterpart of sinn7_expand */
+static inline void sinn7_pack(const struct sinn7_encoder *encoder, u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int done = encoder->pack ? encoder->pack(out, in, len) : 0;
+	
+	sinn7_scalar_pack(out + done, in + done * 8, len - done);
+}
+
+/* The wire bytes of a frame are its two samples, BIG ENDIAN with 24 bits each.
+ * Every sample format gets its own routine, so there is no branching per
+ * sample. They convert numFrames stereo frames from frames into wire, the
+ * from_wire routines the other way round.
+ */
+
+/* 16 bit samples get a zero LOW-Byte */
+static void sinn7_s16_le_to_wire(u8 *wire, const u8 *frames, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 4, wire += PCM_WIRE_FRAME) {
+		wire[0] = frames[1]; /* HIGH-Byte */
+		wire[1] = frames[0]; /* MIDDLE-Byte */
+		wire[2] = 0x0;       /* LOW-Byte */
+		wire[3] = frames[3];
+		wire[4] = frames[2];
+		wire[5] = 0x0;
+	}
+}
+
+/* Packed 24 bit samples */
+static void sinn7_s24_3le_to_wire(u8 *wire, const u8 *frames, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 6, wire += PCM_WIRE_FRAME) {
+		wire[0] = frames[2]; /* HIGH-Byte */
+		wire[1] = frames[1]; /* MIDDLE-Byte */
+		wire[2] = frames[0]; /* LOW-Byte */
+		wire[3] = frames[5];
+		wire[4] = frames[4];
+		wire[5] = frames[3];
+	}
+}
+
+/* 24 bit samples in the lower bytes of 32 bits */
+static void sinn7_s24_le_to_wire(u8 *wire, const u8 *frames, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 8, wire += PCM_WIRE_FRAME) {
+		wire[0] = frames[2]; /* HIGH-Byte */
+		wire[1] = frames[1]; /* MIDDLE-Byte */
+		wire[2] = frames[0]; /* LOW-Byte */
+		wire[3] = frames[6];
+		wire[4] = frames[5];
+		wire[5] = frames[4];
+	}
+}
+
+/* 32 bit samples, the device only takes the upper 24 bits */
+static void sinn7_s32_le_to_wire(u8 *wire, const u8 *frames, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 8, wire += PCM_WIRE_FRAME) {
+		wire[0] = frames[3]; /* HIGH-Byte */
+		wire[1] = frames[2]; /* MIDDLE-Byte */
+		wire[2] = frames[1]; /* LOW-Byte */
+		wire[3] = frames[7];
+		wire[4] = frames[6];
+		wire[5] = frames[5];
+	}
+}
+
+/* 16 bit samples drop the LOW-Byte */
+static void sinn7_s16_le_from_wire(u8 *frames, const u8 *wire, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 4, wire += PCM_WIRE_FRAME) {
+		frames[0] = wire[1];
+		frames[1] = wire[0];
+		frames[2] = wire[4];
+		frames[3] = wire[3];
+	}
+}
+
+static void sinn7_s24_3le_from_wire(u8 *frames, const u8 *wire, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 6, wire += PCM_WIRE_FRAME) {
+		frames[0] = wire[2];
+		frames[1] = wire[1];
+		frames[2] = wire[0];
+		frames[3] = wire[5];
+		frames[4] = wire[4];
+		frames[5] = wire[3];
+	}
+}
+
+/* The unused upper byte gets the sign extension */
+static void sinn7_s24_le_from_wire(u8 *frames, const u8 *wire, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 8, wire += PCM_WIRE_FRAME) {
+		frames[0] = wire[2];
+		frames[1] = wire[1];
+		frames[2] = wire[0];
+		frames[3] = (wire[0] & 0x80) ? 0xFF : 0x0;
+		frames[4] = wire[5];
+		frames[5] = wire[4];
+		frames[6] = wire[3];
+		frames[7] = (wire[3] & 0x80) ? 0xFF : 0x0;
+	}
+}
+
+static void sinn7_s32_le_from_wire(u8 *frames, const u8 *wire, unsigned int numFrames)
+{
+	for (; numFrames; numFrames--, frames += 8, wire += PCM_WIRE_FRAME) {
+		frames[0] = 0x0;
+		frames[1] = wire[2];
+		frames[2] = wire[1];
+		frames[3] = wire[0];
+		frames[4] = 0x0;
+		frames[5] = wire[5];
+		frames[6] = wire[4];
+		frames[7] = wire[3];
+	}
+}
+
+const struct sinn7_format sinn7_format_s16_le = {
+	.name = "S16_LE",
+	.frameBytes = 4,
+	.to_wire = sinn7_s16_le_to_wire,
+	.from_wire = sinn7_s16_le_from_wire,
+};
+
+const struct sinn7_format sinn7_format_s24_3le = {
+	.name = "S24_3LE",
+	.frameBytes = 6,
+	.to_wire = sinn7_s24_3le_to_wire,
+	.from_wire = sinn7_s24_3le_from_wire,
+};
+
+const struct sinn7_format sinn7_format_s24_le = {
+	.name = "S24_LE",
+	.frameBytes = 8,
+	.to_wire = sinn7_s24_le_to_wire,
+	.from_wire = sinn7_s24_le_from_wire,
+};
+
+const struct sinn7_format sinn7_format_s32_le = {
+	.name = "S32_LE",
+	.frameBytes = 8,
+	.to_wire = sinn7_s32_le_to_wire,
+	.from_wire = sinn7_s32_le_from_wire,
+};
+
+const struct sinn7_format *const sinn7_formats[] = {
+	&sinn7_format_s16_le,
+	&sinn7_format_s24_3le,
+	&sinn7_format_s24_le,
+	&sinn7_format_s32_le,
+	NULL
+};
+
+/* A block of silence: the zero frames and the padding frame which terminates each block */
+static const u8 sinn7_silent_block[PCM_BLOCK_SIZE] = {
+	[PCM_BLOCK_FRAMES * PCM_FRAME_SIZE] = 0xFD,
+	[PCM_BLOCK_FRAMES * PCM_FRAME_SIZE + 1] = 0xFF,
+};
+
+/* Writes the padding frame which terminates each block */
+static inline void sinn7_block_padding(u8 *block)
+{
+	memcpy(block + PCM_BLOCK_FRAMES * PCM_FRAME_SIZE, sinn7_silent_block + PCM_BLOCK_FRAMES * PCM_FRAME_SIZE,
+	       PCM_BLOCK_SIZE - PCM_BLOCK_FRAMES * PCM_FRAME_SIZE);
+}
+
+/**
+ * This method converts a default PCM sequence into an usb-ready buffer to be used with the SINN7 Interface.
+ * Each "Block" contains 10 Frames and ends with a Padding Frame. The frames are written straight to their
+ * final position, so a sequence which wraps around in the source can be converted with two calls.
+ * Per Block, the frames are collected as wire bytes first, so the encoder can expand them in one go.
+ * 
+ * @param targetBuffer The Buffer for the output data
+ * @param frameIndex The Frame within targetBuffer to start at (the Number of frames already converted).
+ * @param frameBuffer The Address where the frames are stored. It's size has to equal numFrames * format->frameBytes
+ * @param numFrames The Number of frames in the framebuffer.
+ * @param format The sample format of the frames.
+ * @param encoder The encoder to do the bit expansion with, it has to be claimed already (see sinn7_encoder_begin).
+ */
+void sinn7_frames_to_buffer(void *targetBuffer, uint32_t frameIndex, const void *frameBuffer,
+			    uint32_t numFrames, const struct sinn7_format *format,
+			    const struct sinn7_encoder *encoder)
+{
+	u8 wire[PCM_WIRE_BLOCK];
+	const u8 *frame = frameBuffer;
+	u8 *block = targetBuffer + (frameIndex / PCM_BLOCK_FRAMES) * PCM_BLOCK_SIZE;
+	uint32_t frameId = frameIndex % PCM_BLOCK_FRAMES; /* position inside the current block */
+	
+	/* The tail of the wire block has no frames, its expansion is overwritten by the padding */
+	memset(wire + PCM_BLOCK_FRAMES * PCM_WIRE_FRAME, 0, PCM_WIRE_BLOCK - PCM_BLOCK_FRAMES * PCM_WIRE_FRAME);
+	
+	while (numFrames) {
+		const uint32_t currentFrames = min_t(uint32_t, numFrames, PCM_BLOCK_FRAMES - frameId);
+		
+		format->to_wire(wire, frame, currentFrames);
+		frame += currentFrames * format->frameBytes;
+		
+		if (frameId == 0 && currentFrames == PCM_BLOCK_FRAMES) {
+			/* A whole block: Expand the rounded up wire block, it ends within the padding frame */
+			sinn7_expand(encoder, block, wire, PCM_WIRE_BLOCK);
+		} else {
+			sinn7_expand(encoder, block + frameId * PCM_FRAME_SIZE, wire, currentFrames * PCM_WIRE_FRAME);
+		}
+		
+		numFrames -= currentFrames;
+		frameId += currentFrames;
+		
+		if (frameId == PCM_BLOCK_FRAMES) {
+			sinn7_block_padding(block);
+			block += PCM_BLOCK_SIZE;
+			frameId = 0;
+		}
+	}
+}
+
+/**
+ * Terminates a buffer filled by sinn7_frames_to_buffer: The missing frames of a partial last block
+ * are silenced and the block gets its Padding Frame.
+ * 
+ * @param targetBuffer The Buffer for the output data
+ * @param numFrames The Number of frames which have been converted into targetBuffer.
+ */
+void sinn7_finish_buffer(void *targetBuffer, uint32_t numFrames)
+{
+	u8 *block = targetBuffer + (numFrames / PCM_BLOCK_FRAMES) * PCM_BLOCK_SIZE;
+	const uint32_t frameId = numFrames % PCM_BLOCK_FRAMES;
+	
+	if (frameId == 0)
+		return;
+	
+	memset(block + frameId * PCM_FRAME_SIZE, 0, (PCM_BLOCK_FRAMES - frameId) * PCM_FRAME_SIZE);
+	sinn7_block_padding(block);
+}
+
+/**
+ * Fills the buffer with numFrames frames of silence.
+ * 
+ * @param targetBuffer The Buffer for the output data
+ * @param numFrames The Number of silent frames.
+ */
+void sinn7_silence_to_buffer(void *targetBuffer, uint32_t numFrames)
+{
+	const size_t size = sinn7_framecount_to_buffersize(numFrames);
+	size_t offset;
+	
+	for (offset = 0; offset < size; offset += PCM_BLOCK_SIZE)
+		memcpy(targetBuffer + offset, sinn7_silent_block, PCM_BLOCK_SIZE);
+}
+
+/**
+ * The reverse of sinn7_frames_to_buffer: Converts frames received from the SINN7 Interface into a
+ * default PCM sequence. The padding frames are skipped. Like for the playback, a sequence which wraps
+ * around in the target can be converted with two calls.
+ * 
+ * @param frameBuffer The Buffer for the PCM frames. It's size has to equal numFrames * format->frameBytes
+ * @param sourceBuffer The Buffer with the device data, as received from the device.
+ * @param frameIndex The Frame within sourceBuffer to start at (the Number of frames already converted).
+ * @param numFrames The Number of frames to convert.
+ * @param format The sample format of the frames.
+ * @param encoder The encoder to do the bit packing with, it has to be claimed already (see sinn7_encoder_begin).
+ */
+void sinn7_buffer_to_frames(void *frameBuffer, const void *sourceBuffer, uint32_t frameIndex,
+			    uint32_t numFrames, const struct sinn7_format *format,
+			    const struct sinn7_encoder *encoder)
+{
+	u8 wire[PCM_WIRE_BLOCK];
+	u8 *frame = frameBuffer;
+	const u8 *block = sourceBuffer + (frameIndex / PCM_BLOCK_FRAMES) * PCM_BLOCK_SIZE;
+	uint32_t frameId = frameIndex % PCM_BLOCK_FRAMES; /* position inside the current block */
+	
+	while (numFrames) {
+		const uint32_t currentFrames = min_t(uint32_t, numFrames, PCM_BLOCK_FRAMES - frameId);
+		
+		if (frameId == 0 && currentFrames == PCM_BLOCK_FRAMES) {
+			/* A whole block: Pack the rounded up wire block, its tail is made of the padding frame */
+			sinn7_pack(encoder, wire, block, PCM_WIRE_BLOCK);
+		} else {
+			sinn7_pack(encoder, wire, block + frameId * PCM_FRAME_SIZE, currentFrames * PCM_WIRE_FRAME);
+		}
+		
+		format->from_wire(frame, wire, currentFrames);
+		frame += currentFrames * format->frameBytes;
+		
+		numFrames -= currentFrames;
+		frameId += currentFrames;
+		
+		if (frameId == PCM_BLOCK_FRAMES) {
+			block += PCM_BLOCK_SIZE;
+			frameId = 0;
+		}
+	}
+}
@@ -0,0 +1,144 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SINN7_ENCODE_H
+#define SINN7_ENCODE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+/* Userspace build of the encoder, only what the encoder files need */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint64_t u64;
+
+#define __aligned(x) __attribute__((aligned(x)))
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+
+static inline u64 get_unaligned_le64(const void *p)
+{
+	u64 value;
+	
+	memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	return value;
+}
+#endif /* __KERNEL__ */
+
+#define PCM_BLOCK_SIZE	512
+#define PCM_BLOCK_FRAMES 10 /* Frames per block, the rest of the block is padding */
+#define PCM_FRAME_SIZE  48  /* One stereo frame on the wire: 2 * 24 bit, one byte per bit */
+#define PCM_WIRE_FRAME  6   /* One stereo frame before the bit expansion: 2 * 3 bytes, big endian */
+#define PCM_WIRE_BLOCK  64  /* The wire bytes of a block, rounded up to a multiple of the vector width */
+
+/* The device wants each sample bit as a byte of its own (0x0 or 0x1), most
+ * significant bit first. An encoder expands sample bytes into these device
+ * bytes, which is the expensive part of converting a period. The captured
+ * data comes in the same format and is packed back by the same encoder.
+ */
+struct sinn7_encoder {
+	const char *name;
+	
+	/* Whether the cpu supports this encoder, may be NULL (always usable) */
+	bool (*usable)(void);
+	
+	/* Claim/release the vector unit around a run of expand calls. begin may
+	 * refuse (e.g. in an interrupt context), both may be NULL.
+	 */
+	bool (*begin)(void);
+	void (*end)(void);
+	
+	/* Expands at most len sample bytes into len * 8 device bytes and returns
+	 * how many sample bytes were done. Vector encoders only do whole vectors,
+	 * the caller takes care of the rest.
+	 */
+	unsigned int (*expand)(u8 *out, const u8 *in, unsigned int len);
+	
+	/* The reverse: packs len * 8 device bytes into len sample bytes (only the
+	 * lowest bit of a device byte counts). Works like expand, may be NULL.
+	 */
+	unsigned int (*pack)(u8 *out, const u8 *in, unsigned int len);
+};
+
+/* A PCM sample format (always stereo) the device data can be made of */
+struct sinn7_format {
+	const char *name;
+	u8 frameBytes; /* bytes of one stereo frame */
+	
+	/* Converts numFrames frames into their wire bytes, PCM_WIRE_FRAME each */
+	void (*to_wire)(u8 *wire, const u8 *frames, unsigned int numFrames);
+	
+	/* The reverse of to_wire, for the capture stream */
+	void (*from_wire)(u8 *frames, const u8 *wire, unsigned int numFrames);
+};
+
+extern const struct sinn7_format sinn7_format_s16_le;
+extern const struct sinn7_format sinn7_format_s24_3le;
+extern const struct sinn7_format sinn7_format_s24_le;
+extern const struct sinn7_format sinn7_format_s32_le;
+
+/* All supported formats, NULL terminated */
+extern const struct sinn7_format *const sinn7_formats[];
+
+extern const struct sinn7_encoder sinn7_encoder_scalar;
+
+#ifdef CONFIG_X86
+extern const struct sinn7_encoder sinn7_encoder_sse2;
+#ifdef SINN7_AS_AVX2
+extern const struct sinn7_encoder sinn7_encoder_avx2;
+#endif
+#endif /* CONFIG_X86 */
+
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+extern const struct sinn7_encoder sinn7_encoder_neon;
+unsigned int sinn7_neon_expand(u8 *out, const u8 *in, unsigned int len);
+unsigned int sinn7_neon_pack(u8 *out, const u8 *in, unsigned int len);
+#endif
+
+/* All encoders built for this architecture, the preferred first, NULL terminated */
+extern const struct sinn7_encoder *const sinn7_encoders[];
+
+bool sinn7_encoder_usable(const struct sinn7_encoder *encoder);
+const struct sinn7_encoder *sinn7_encoder_select(void);
+
+/* Claims the encoder for a run of conversions. Returns the encoder to use,
+ * which is the scalar one if the vector unit can't be used right now.
+ */
+const struct sinn7_encoder *sinn7_encoder_begin(const struct sinn7_encoder *encoder);
+void sinn7_encoder_end(const struct sinn7_encoder *encoder);
+
+static inline size_t sinn7_framecount_to_buffersize(const uint32_t numFrames) {
+	/* See sinn7_frames_to_buffer for the calculation base */
+	return ((numFrames / 10) + (numFrames % 10 > 0 ? 1 : 0)) * PCM_BLOCK_SIZE;
+}
+
+void sinn7_frames_to_buffer(void *targetBuffer, uint32_t frameIndex, const void *frameBuffer,
+			    uint32_t numFrames, const struct sinn7_format *format,
+			    const struct sinn7_encoder *encoder);
+void sinn7_finish_buffer(void *targetBuffer, uint32_t numFrames);
+void sinn7_silence_to_buffer(void *targetBuffer, uint32_t numFrames);
+void sinn7_buffer_to_frames(void *frameBuffer, const void *sourceBuffer, uint32_t frameIndex,
+			    uint32_t numFrames, const struct sinn7_format *format,
+			    const struct sinn7_encoder *encoder);
+
+#endif /* SINN7_ENCODE_H */
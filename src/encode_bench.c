@@ -0,0 +1,241 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/* Userspace microbenchmark of the encoder (make bench).
+ *
+ * Every usable encoder is checked against the scalar one first, then each
+ * combination of encoder, sample format and period size is timed, for the
+ * playback (encode) and the capture (decode) direction. One JSON object per
+ * line is printed to stdout, so the results can be compared by scripts. The
+ * exit code is non-zero if any encoder produced wrong data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "encode.h"
+
+#define BENCH_MAX_PERIODS 16
+static uint32_t bench_periods[BENCH_MAX_PERIODS] = { 10, 250, 390, 1024 };
+static int bench_num_periods = 4;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_fill(u8 *buffer, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buffer[i] = rand();
+}
+
+/* Converts a period the way the driver does, including claiming the encoder */
+static void bench_convert(const struct sinn7_encoder *encoder, void *target, const void *frames,
+			  uint32_t numFrames, const struct sinn7_format *format, uint32_t split)
+{
+	encoder = sinn7_encoder_begin(encoder);
+	sinn7_frames_to_buffer(target, 0, frames, split, format, encoder);
+	sinn7_frames_to_buffer(target, split, frames + split * format->frameBytes,
+			       numFrames - split, format, encoder);
+	sinn7_finish_buffer(target, numFrames);
+	sinn7_encoder_end(encoder);
+}
+
+/* Converts captured data back, split like bench_convert */
+static void bench_deconvert(const struct sinn7_encoder *encoder, void *frames, const void *source,
+			    uint32_t numFrames, const struct sinn7_format *format, uint32_t split)
+{
+	encoder = sinn7_encoder_begin(encoder);
+	sinn7_buffer_to_frames(frames, source, 0, split, format, encoder);
+	sinn7_buffer_to_frames(frames + split * format->frameBytes, source, split,
+			       numFrames - split, format, encoder);
+	sinn7_encoder_end(encoder);
+}
+
+/* Compares the encoder against the scalar one, also for ring buffer wrap-arounds */
+static bool bench_verify(const struct sinn7_encoder *encoder, const struct sinn7_format *format,
+			 uint32_t numFrames)
+{
+	const size_t outSize = sinn7_framecount_to_buffersize(numFrames);
+	u8 *frames = malloc(numFrames * format->frameBytes);
+	u8 *expected = malloc(outSize);
+	u8 *actual = malloc(outSize);
+	uint32_t split;
+	bool ok = true;
+
+	bench_fill(frames, numFrames * format->frameBytes);
+	bench_convert(&sinn7_encoder_scalar, expected, frames, numFrames, format, numFrames);
+
+	for (split = 0; split <= numFrames && ok; split += 7) {
+		memset(actual, 0xAA, outSize);
+		bench_convert(encoder, actual, frames, numFrames, format, split);
+		if (memcmp(expected, actual, outSize) != 0) {
+			fprintf(stderr, "%s: wrong output for %s, %u frames, split at %u\n",
+				encoder->name, format->name, numFrames, split);
+			ok = false;
+		}
+	}
+
+	free(frames);
+	free(expected);
+	free(actual);
+	return ok;
+}
+
+/* Decodes device data with noise in the unused device bits and checks that
+ * encoding the result again gives the clean device data back.
+ */
+static bool bench_verify_decode(const struct sinn7_encoder *encoder, const struct sinn7_format *format,
+				uint32_t numFrames)
+{
+	const size_t inSize = numFrames * format->frameBytes;
+	const size_t outSize = sinn7_framecount_to_buffersize(numFrames);
+	u8 *frames = malloc(inSize);
+	u8 *clean = malloc(outSize);
+	u8 *noisy = malloc(outSize);
+	u8 *again = malloc(outSize);
+	uint32_t split;
+	size_t i;
+	bool ok = true;
+
+	bench_fill(frames, inSize);
+	bench_convert(&sinn7_encoder_scalar, clean, frames, numFrames, format, numFrames);
+	for (i = 0; i < outSize; i++)
+		noisy[i] = clean[i] | (rand() & 0xFE);
+
+	for (split = 0; split <= numFrames && ok; split += 7) {
+		memset(frames, 0xAA, inSize);
+		bench_deconvert(encoder, frames, noisy, numFrames, format, split);
+		bench_convert(&sinn7_encoder_scalar, again, frames, numFrames, format, numFrames);
+		if (memcmp(clean, again, outSize) != 0) {
+			fprintf(stderr, "%s: wrong decoding for %s, %u frames, split at %u\n",
+				encoder->name, format->name, numFrames, split);
+			ok = false;
+		}
+	}
+
+	free(frames);
+	free(clean);
+	free(noisy);
+	free(again);
+	return ok;
+}
+
+static void bench_run(const struct sinn7_encoder *encoder, const struct sinn7_format *format,
+		      uint32_t numFrames, double minTime, bool decode)
+{
+	const size_t inSize = numFrames * format->frameBytes;
+	const size_t outSize = sinn7_framecount_to_buffersize(numFrames);
+	u8 *frames = malloc(inSize);
+	u8 *target = malloc(outSize);
+	unsigned long iterations = 0;
+	unsigned long batch = 16;
+	double start, elapsed;
+	unsigned long i;
+
+	bench_fill(frames, inSize);
+	bench_convert(encoder, target, frames, numFrames, format, numFrames); /* warm up */
+
+	start = bench_now();
+	do {
+		for (i = 0; i < batch; i++) {
+			if (decode)
+				bench_deconvert(encoder, frames, target, numFrames, format, numFrames);
+			else
+				bench_convert(encoder, target, frames, numFrames, format, numFrames);
+		}
+		iterations += batch;
+		batch *= 2;
+		elapsed = bench_now() - start;
+	} while (elapsed < minTime);
+
+	printf("{\"encoder\": \"%s\", \"op\": \"%s\", \"format\": \"%s\", \"period_frames\": %u, \"iterations\": %lu, "
+	       "\"ns_per_frame\": %.3f, \"ns_per_period\": %.1f, \"pcm_mb_s\": %.1f, \"usb_mb_s\": %.1f}\n",
+	       encoder->name, decode ? "decode" : "encode", format->name, numFrames, iterations,
+	       elapsed * 1e9 / ((double)iterations * numFrames),
+	       elapsed * 1e9 / iterations,
+	       inSize * (double)iterations / elapsed / 1e6,
+	       outSize * (double)iterations / elapsed / 1e6);
+
+	free(frames);
+	free(target);
+}
+
+static void bench_usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t seconds per measurement] [-p period frames]...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	double minTime = 0.2;
+	bool customPeriods = false;
+	bool ok = true;
+	int opt;
+	int e, f, p;
+
+	while ((opt = getopt(argc, argv, "t:p:h")) != -1) {
+		switch (opt) {
+		case 't':
+			minTime = atof(optarg);
+			break;
+		case 'p':
+			if (!customPeriods) {
+				bench_num_periods = 0;
+				customPeriods = true;
+			}
+			if (bench_num_periods == BENCH_MAX_PERIODS || atoi(optarg) <= 0) {
+				bench_usage(argv[0]);
+				return 2;
+			}
+			bench_periods[bench_num_periods++] = atoi(optarg);
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 2;
+		}
+	}
+
+	srand(7);
+
+	for (e = 0; sinn7_encoders[e]; e++) {
+		if (!sinn7_encoder_usable(sinn7_encoders[e]))
+			continue;
+
+		for (f = 0; sinn7_formats[f]; f++) {
+			for (p = 0; p < bench_num_periods; p++) {
+				if (!bench_verify(sinn7_encoders[e], sinn7_formats[f], bench_periods[p]) ||
+				    !bench_verify_decode(sinn7_encoders[e], sinn7_formats[f], bench_periods[p])) {
+					ok = false;
+					continue;
+				}
+				bench_run(sinn7_encoders[e], sinn7_formats[f], bench_periods[p], minTime, false);
+				bench_run(sinn7_encoders[e], sinn7_formats[f], bench_periods[p], minTime, true);
+			}
+		}
+	}
+
+	return ok ? 0 : 1;
+}
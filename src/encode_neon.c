@@ -0,0 +1,55 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <asm/neon.h>
+#include <asm/simd.h>
+#else
+/* Userspace build, the vector registers are always usable there */
+#define may_use_simd() true
+#define kernel_neon_begin() do { } while (0)
+#define kernel_neon_end() do { } while (0)
+#endif
+
+#include "encode.h"
+
+/* The intrinsics live in encode_neon_core.c, which has to be built without
+ * the kernel headers (see the Makefile), just like lib/raid6 does it.
+ */
+
+static bool sinn7_neon_begin(void)
+{
+	if (!may_use_simd())
+		return false;
+	
+	kernel_neon_begin();
+	return true;
+}
+
+static void sinn7_neon_end(void)
+{
+	kernel_neon_end();
+}
+
+const struct sinn7_encoder sinn7_encoder_neon = {
+	.name = "neon",
+	.begin = sinn7_neon_begin,
+	.end = sinn7_neon_end,
+	.expand = sinn7_neon_expand,
+	.pack = sinn7_neon_pack,
+};
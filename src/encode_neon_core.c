@@ -0,0 +1,83 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <arm_neon.h>
+
+unsigned int sinn7_neon_expand(unsigned char *out, const unsigned char *in, unsigned int len);
+unsigned int sinn7_neon_pack(unsigned char *out, const unsigned char *in, unsigned int len);
+
+/* vqtbl1q indices: picks two sample bytes, eight times each */
+static const uint8_t sinn7_neon_shuffle[8][16] = {
+	{  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,  1,  1,  1,  1 },
+	{  2,  2,  2,  2,  2,  2,  2,  2,  3,  3,  3,  3,  3,  3,  3,  3 },
+	{  4,  4,  4,  4,  4,  4,  4,  4,  5,  5,  5,  5,  5,  5,  5,  5 },
+	{  6,  6,  6,  6,  6,  6,  6,  6,  7,  7,  7,  7,  7,  7,  7,  7 },
+	{  8,  8,  8,  8,  8,  8,  8,  8,  9,  9,  9,  9,  9,  9,  9,  9 },
+	{ 10, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 11 },
+	{ 12, 12, 12, 12, 12, 12, 12, 12, 13, 13, 13, 13, 13, 13, 13, 13 },
+	{ 14, 14, 14, 14, 14, 14, 14, 14, 15, 15, 15, 15, 15, 15, 15, 15 }
+};
+
+static const uint8_t sinn7_neon_bits[16] = {
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+};
+
+/* 16 sample bytes into 128 device bytes: shuffle, test against the bit masks
+ * (all ones if set) and shift down to 0x1.
+ */
+unsigned int sinn7_neon_expand(unsigned char *out, const unsigned char *in, unsigned int len)
+{
+	const uint8x16_t bits = vld1q_u8(sinn7_neon_bits);
+	unsigned int done;
+	int i;
+	
+	for (done = 0; done + 16 <= len; done += 16, in += 16, out += 128) {
+		const uint8x16_t src = vld1q_u8(in);
+		
+		for (i = 0; i < 8; i++) {
+			uint8x16_t v = vqtbl1q_u8(src, vld1q_u8(sinn7_neon_shuffle[i]));
+			
+			vst1q_u8(out + 16 * i, vshrq_n_u8(vtstq_u8(v, bits), 7));
+		}
+	}
+	
+	return done;
+}
+
+static const int8_t sinn7_neon_shifts[16] = {
+	7, 6, 5, 4, 3, 2, 1, 0, 7, 6, 5, 4, 3, 2, 1, 0
+};
+
+/* 16 device bytes into 2 sample bytes: shift the lowest bit of each device
+ * byte to its place and add up the eight device bytes of a sample byte.
+ */
+unsigned int sinn7_neon_pack(unsigned char *out, const unsigned char *in, unsigned int len)
+{
+	const int8x16_t shifts = vld1q_s8(sinn7_neon_shifts);
+	const uint8x16_t ones = vdupq_n_u8(1);
+	unsigned int done;
+	
+	for (done = 0; done + 2 <= len; done += 2, in += 16, out += 2) {
+		const uint8x16_t v = vshlq_u8(vandq_u8(vld1q_u8(in), ones), shifts);
+		
+		out[0] = vaddv_u8(vget_low_u8(v));
+		out[1] = vaddv_u8(vget_high_u8(v));
+	}
+	
+	return done;
+}
@@ -0,0 +1,247 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#else
+/* Userspace build, the vector registers are always usable there */
+#define irq_fpu_usable() true
+#define kernel_fpu_begin() do { } while (0)
+#define kernel_fpu_end() do { } while (0)
+#define boot_cpu_has(feature) __builtin_cpu_supports(feature)
+#define X86_FEATURE_XMM2 "sse2"
+#define X86_FEATURE_AVX "avx"
+#define X86_FEATURE_AVX2 "avx2"
+#endif
+
+#include "encode.h"
+
+/* The kernel is built with -mno-sse, so gcc refuses vector registers as asm
+ * clobbers. They are left out there like in asm/xor.h: kernel_fpu_begin saved
+ * the vector state and the compiled kernel code never holds anything in them.
+ * In userspace they have to be named.
+ */
+#ifdef __KERNEL__
+#define SINN7_CLOBBERS(...) "memory"
+#else
+#define SINN7_CLOBBERS(...) "memory", __VA_ARGS__
+#endif
+
+/* Bit masks in device byte order, a sample byte which got broadcasted over
+ * eight lanes becomes the device bytes by masking and comparing against them.
+ */
+static const u8 sinn7_x86_bits[32] __aligned(32) = {
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+	0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+};
+
+static const u8 sinn7_x86_ones[16] __aligned(16) = {
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01
+};
+
+static bool sinn7_x86_begin(void)
+{
+	if (!irq_fpu_usable())
+		return false;
+	
+	kernel_fpu_begin();
+	return true;
+}
+
+static void sinn7_x86_end(void)
+{
+	kernel_fpu_end();
+}
+
+static bool sinn7_sse2_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+/* Turns the broadcasted sample bytes in r into device bytes and stores them */
+#define SSE2_STORE(r, off) \
+	"pand %[bits], " r "\n\t" \
+	"pcmpeqb %[bits], " r "\n\t" \
+	"pand %[ones], " r "\n\t" \
+	"movdqu " r ", " #off "(%[out])\n\t"
+
+/* r holds four sample bytes, each repeated four times. Widen them to eight
+ * repetitions (two sample bytes per register) and store them.
+ */
+#define SSE2_SPLIT(r, off) \
+	"movdqa " r ", %%xmm4\n\t" \
+	"punpckldq " r ", " r "\n\t" \
+	"punpckhdq %%xmm4, %%xmm4\n\t" \
+	SSE2_STORE(r, off) \
+	SSE2_STORE("%%xmm4", off + 16)
+
+/* SSE2 lacks a byte shuffle, so the sample bytes are broadcasted with a tree
+ * of unpacks: 16 sample bytes become 128 device bytes per iteration.
+ */
+static unsigned int sinn7_sse2_expand(u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int done;
+	
+	for (done = 0; done + 16 <= len; done += 16, in += 16, out += 128) {
+		asm volatile("movdqu (%[in]), %%xmm0\n\t"
+			     "movdqa %%xmm0, %%xmm1\n\t"
+			     "punpcklbw %%xmm0, %%xmm0\n\t"
+			     "punpckhbw %%xmm1, %%xmm1\n\t"
+			     "movdqa %%xmm0, %%xmm2\n\t"
+			     "punpcklwd %%xmm0, %%xmm0\n\t"
+			     "punpckhwd %%xmm2, %%xmm2\n\t"
+			     "movdqa %%xmm1, %%xmm3\n\t"
+			     "punpcklwd %%xmm1, %%xmm1\n\t"
+			     "punpckhwd %%xmm3, %%xmm3\n\t"
+			     SSE2_SPLIT("%%xmm0", 0)
+			     SSE2_SPLIT("%%xmm2", 32)
+			     SSE2_SPLIT("%%xmm1", 64)
+			     SSE2_SPLIT("%%xmm3", 96)
+			     :
+			     : [in] "r" (in), [out] "r" (out),
+			       [bits] "m" (sinn7_x86_bits), [ones] "m" (sinn7_x86_ones)
+			     : SINN7_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3", "xmm4"));
+	}
+	
+	return done;
+}
+
+/* pmovmskb collects the top bit of each byte, the lowest bit of the device bytes
+ * is moved there. The device bytes of a sample byte are reversed first (word
+ * shuffles and a byte swap), as pmovmskb puts the first byte into the lowest
+ * bit: 16 device bytes become 2 sample bytes per iteration.
+ */
+static unsigned int sinn7_sse2_pack(u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int done;
+	unsigned int mask;
+	
+	for (done = 0; done + 2 <= len; done += 2, in += 16, out += 2) {
+		asm volatile("movdqu (%[in]), %%xmm0\n\t"
+			     "pshuflw $0x1b, %%xmm0, %%xmm0\n\t"
+			     "pshufhw $0x1b, %%xmm0, %%xmm0\n\t"
+			     "movdqa %%xmm0, %%xmm1\n\t"
+			     "psllw $8, %%xmm0\n\t"
+			     "psrlw $8, %%xmm1\n\t"
+			     "por %%xmm1, %%xmm0\n\t"
+			     "psllw $7, %%xmm0\n\t"
+			     "pmovmskb %%xmm0, %[mask]\n\t"
+			     : [mask] "=r" (mask)
+			     : [in] "r" (in)
+			     : SINN7_CLOBBERS("xmm0", "xmm1"));
+		out[0] = mask;
+		out[1] = mask >> 8;
+	}
+	
+	return done;
+}
+
+const struct sinn7_encoder sinn7_encoder_sse2 = {
+	.name = "sse2",
+	.usable = sinn7_sse2_usable,
+	.begin = sinn7_x86_begin,
+	.end = sinn7_x86_end,
+	.expand = sinn7_sse2_expand,
+	.pack = sinn7_sse2_pack,
+};
+
+#ifdef SINN7_AS_AVX2
+/* vpshufb indices: the broadcasted dword holds four sample bytes, the low lane
+ * picks the first two, the high lane the last two, eight times each.
+ */
+static const u8 sinn7_avx2_shuffle[32] __aligned(32) = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3
+};
+
+static bool sinn7_avx2_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_AVX);
+}
+
+/* Four sample bytes into 32 device bytes: broadcast, shuffle, mask, compare */
+#define AVX2_EXPAND(off) \
+	"vpbroadcastd " #off "/8(%[in]), %%ymm0\n\t" \
+	"vpshufb %[shuffle], %%ymm0, %%ymm0\n\t" \
+	"vpand %[bits], %%ymm0, %%ymm0\n\t" \
+	"vpcmpeqb %[bits], %%ymm0, %%ymm0\n\t" \
+	"vpabsb %%ymm0, %%ymm0\n\t" \
+	"vmovdqu %%ymm0, " #off "(%[out])\n\t"
+
+static unsigned int sinn7_avx2_expand(u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int done;
+	
+	for (done = 0; done + 16 <= len; done += 16, in += 16, out += 128) {
+		asm volatile(AVX2_EXPAND(0)
+			     AVX2_EXPAND(32)
+			     AVX2_EXPAND(64)
+			     AVX2_EXPAND(96)
+			     :
+			     : [in] "r" (in), [out] "r" (out),
+			       [bits] "m" (sinn7_x86_bits), [shuffle] "m" (sinn7_avx2_shuffle)
+			     : SINN7_CLOBBERS("xmm0"));
+	}
+	asm volatile("vzeroupper" : : : "memory");
+	
+	return done;
+}
+
+/* vpshufb indices which reverse the device bytes of each sample byte */
+static const u8 sinn7_avx2_reverse[32] __aligned(32) = {
+	7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+	7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+};
+
+/* 32 device bytes into 4 sample bytes: reverse, move the bit up, collect */
+static unsigned int sinn7_avx2_pack(u8 *out, const u8 *in, unsigned int len)
+{
+	unsigned int done;
+	unsigned int mask;
+	
+	for (done = 0; done + 4 <= len; done += 4, in += 32, out += 4) {
+		asm volatile("vmovdqu (%[in]), %%ymm0\n\t"
+			     "vpshufb %[reverse], %%ymm0, %%ymm0\n\t"
+			     "vpsllw $7, %%ymm0, %%ymm0\n\t"
+			     "vpmovmskb %%ymm0, %[mask]\n\t"
+			     : [mask] "=r" (mask)
+			     : [in] "r" (in), [reverse] "m" (sinn7_avx2_reverse)
+			     : SINN7_CLOBBERS("xmm0"));
+		out[0] = mask;
+		out[1] = mask >> 8;
+		out[2] = mask >> 16;
+		out[3] = mask >> 24;
+	}
+	asm volatile("vzeroupper" : : : "memory");
+	
+	return done;
+}
+
+const struct sinn7_encoder sinn7_encoder_avx2 = {
+	.name = "avx2",
+	.usable = sinn7_avx2_usable,
+	.begin = sinn7_x86_begin,
+	.end = sinn7_x86_end,
+	.expand = sinn7_avx2_expand,
+	.pack = sinn7_avx2_pack,
+};
+#endif /* SINN7_AS_AVX2 */
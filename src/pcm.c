@@ -16,34 +16,101 @@
  */
 
 #include <linux/slab.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
 #include <sound/pcm.h>
 #include <linux/usb.h>
+#include <linux/usb/audio.h>
 
 #include "pcm.h"
 #include "chip.h"
+#include "encode.h"
+#include "stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 
 #define OUT_EP          0x5
-#define PCM_N_URBS      8
-#define PCM_BLOCK_SIZE	512
-#define MAX_PACKET_SIZE 19968
+#define IN_EP           0x86
+#define PCM_N_URBS      8  /* default of the urbs parameter */
+#define PCM_N_URBS_MIN  2
+#define PCM_N_URBS_MAX  32
+#define MAX_PACKET_SIZE 19968 /* default of the urb_size parameter, 390 frames */
+#define PCM_URB_SIZE_MAX (2 * MAX_PACKET_SIZE)
+#define PCM_BATCH_MAX   8
 #define PCM_BUFFER_SIZE (2 * PCM_N_URBS * MAX_PACKET_SIZE)
 
+/* Higher rates keep the urb rate of 48 kHz: the urb (and its buffer) grows by
+ * this factor, i.e. 1, 2 or 4.
+ */
+#define PCM_RATE_FACTOR(rate) DIV_ROUND_UP(rate, 48000)
+#define PCM_RATE_FACTOR_MAX   PCM_RATE_FACTOR(192000)
+
+/* Timer pacing: periods kept queued ahead of the device. The lead grows when
+ * completions arrive late and shrinks again after PCM_LEAD_SETTLE on-time ones.
+ */
+#define PCM_LEAD_MIN    2
+#define PCM_LEAD_SETTLE 500
+
+/* Drift estimation: the frames the device consumed are measured against the
+ * host clock over windows of PCM_DRIFT_WINDOW, the estimate follows each one
+ * by 1/PCM_DRIFT_WEIGHT. Windows off by more than PCM_DRIFT_MAX (in ppb, 0.2%)
+ * are scheduling hiccups rather than the crystal.
+ */
+#define PCM_DRIFT_WINDOW (4LL * NSEC_PER_SEC)
+#define PCM_DRIFT_WEIGHT 8
+#define PCM_DRIFT_MAX    2000000
+
+static bool streaming = true;
+module_param(streaming, bool, 0644);
+MODULE_PARM_DESC(streaming, "Refill the urbs as soon as they complete instead of polling with a timer (applies at the next stream start).");
+
+/* The urb pipeline, per card these can be overridden in sysfs (see sinn7_pcm_attr_group) */
+static unsigned int urbs = PCM_N_URBS;
+module_param(urbs, uint, 0644);
+MODULE_PARM_DESC(urbs, "Number of urbs per direction, 2-32 (applies at the next prepare of a stopped stream).");
+
+static unsigned int urb_size = MAX_PACKET_SIZE;
+module_param(urb_size, uint, 0644);
+MODULE_PARM_DESC(urb_size, "Maximum size of an urb in bytes up to 48 kHz, higher rates scale it. Rounded down to 512 byte blocks, at most 39936 (applies at the next prepare of a stopped stream).");
+
+static unsigned int batch = 1;
+module_param(batch, uint, 0644);
+MODULE_PARM_DESC(batch, "Transfers of urb_size packed into one urb, 1-8. Above 1 an urb may span several periods, which saves wakeups (applies at the next prepare of a stopped stream).");
+
 struct pcm_urb {
 	struct sinn7_chip *chip;
 
 	struct urb instance;
-	struct usb_anchor submitted;
-	u8 *buffer;
+	u8 *buffer; /* dma-coherent, so usb_submit_urb doesn't map it each time */
+	dma_addr_t dma;
+	unsigned int size; /* of the buffer */
+	unsigned int index; /* in out_urbs or in_urbs */
+	snd_pcm_uframes_t frames; /* submitted with the out urb */
+	snd_pcm_uframes_t silent; /* frames of silence the buffer still holds, 0 for audio */
+	ktime_t due; /* completion of the out urb, for the submit latency */
+	u64 start_ns; /* the urb carries the first frames after the TRIGGER_START at this time, or 0 */
+	unsigned long dma_off; /* alsa buffer position when filled (out) or submitted (in), for the tracepoints */
 };
 
+/* The substreams don't have a lock: The position is published through pos_seq
+ * by its single writer (see sinn7_pcm_publish), active is a plain flag and the
+ * delay bookkeeping is atomic. So the pointer, the trigger and the streaming
+ * engine never wait for each other.
+ */
 struct pcm_substream {
-	spinlock_t lock;
+	seqcount_t pos_seq;
 	struct snd_pcm_substream *instance;
 
 	bool active;
+	bool paused; /* the urbs keep going with silence, the position stays */
+	const struct sinn7_format *format; /* picked at hw_params time */
 	snd_pcm_uframes_t dma_off;    /* current position in alsa dma_area */
 	snd_pcm_uframes_t period_off; /* current position in current period */
+	atomic_t queued; /* playback: frames in the out urbs in flight */
+	atomic64_t completed; /* last urb completion in ns, 0 if none yet, see sinn7_pcm_delay */
+	atomic_t decoding; /* capture: in urb completions at the dma_area, see sinn7_pcm_sync_capture */
 };
 
 enum { /* pcm streaming states */
@@ -58,44 +125,86 @@ struct pcm_runtime {
 	struct snd_pcm *instance;
 
 	struct pcm_substream playback;
+	struct pcm_substream capture;
 	bool panic; /* if set driver won't do anymore pcm on device */
-
-	struct pcm_urb out_urbs[PCM_N_URBS];
+	bool failed; /* an urb failed, the stream stops until the next prepare, see sinn7_pcm_urb_failed */
+	bool out_halted; /* the out endpoint stalled, cleared at the next stream start */
+	bool in_halted;
+	struct work_struct error_work; /* stops a failed stream, see sinn7_pcm_error_work */
+
+	struct pcm_urb out_urbs[PCM_N_URBS_MAX];
+	struct pcm_urb in_urbs[PCM_N_URBS_MAX];
+	unsigned int n_urbs; /* urbs in use per direction */
+	unsigned int cfg_urbs; /* set in sysfs, 0 follows the urbs parameter */
+	unsigned int cfg_urb_size; /* set in sysfs, 0 follows the urb_size parameter */
+	unsigned int cfg_batch; /* set in sysfs, 0 follows the batch parameter */
+	unsigned int batch; /* transfers per urb */
+	u8 *silence; /* max_packet_size bytes of encoded silence, the source of silent urbs */
 
 	struct mutex stream_mutex;
 	u8 stream_state; /* one of STREAM_XXX */
 	u8 extra_freq;
+	unsigned int rate; /* last rate set on the device, 0 if unknown */
+	unsigned int max_packet_size; /* size of the urb buffers, see PCM_RATE_FACTOR */
+	snd_pcm_uframes_t urb_frames_max; /* frames of one transfer of urb_size up to 48 kHz */
 	wait_queue_head_t stream_wait_queue;
 	bool stream_wait_cond;
 	
-	struct timer_list *timer;
+	bool streaming; /* the urbs are refilled as soon as they complete, no timer */
+	atomic_t in_flight; /* submitted urbs which did not complete yet */
+	struct usb_anchor out_anchor; /* the out urbs in flight, drained by sinn7_pcm_stream_stop */
+	DECLARE_BITMAP(idle_urbs, PCM_N_URBS_MAX); /* out urbs waiting for the fill worker */
+	DECLARE_BITMAP(parked_in, PCM_N_URBS_MAX); /* in urbs held back while idle, see sinn7_pcm_idle */
+	struct workqueue_struct *fill_wq;
+	struct work_struct fill_work; /* encodes and submits the idle out urbs, see sinn7_pcm_fill_work */
+	int cpu; /* of the fill worker, -1 for any */
+	atomic64_t start_ns; /* TRIGGER_START of the playback, 0 once its first urb is filled */
+	
+	struct hrtimer timer; /* paces the urbs unless streaming */
+	ktime_t timer_due; /* expiry of the timer which queued the fill worker */
+	atomic_t timer_parked; /* the timer stopped itself while idle, see sinn7_pcm_wake */
+	snd_pcm_uframes_t urb_frames; /* frames per urb, see sinn7_pcm_urb_frames */
+	snd_pcm_uframes_t in_urb_frames; /* of the capture, 0 until it's prepared, see sinn7_pcm_in_urb_frames */
+	atomic64_t urb_ns; /* duration of one urb, see sinn7_pcm_update_pacing */
+	ktime_t last_completion;
+	unsigned int lead; /* number of urbs the timer keeps queued, PCM_LEAD_MIN to n_urbs */
+	unsigned int on_time; /* completions in time since the lead was changed */
+	ktime_t drift_start; /* start of the drift window, 0 if none */
+	u64 drift_frames; /* consumed by the device since drift_start */
+	int drift_ppb; /* device clock against the host clock, see sinn7_pcm_track_drift */
+	const struct sinn7_encoder *encoder; /* picked once at init, see sinn7_encoder_select */
+	
+	struct sinn7_stats stats; /* debugfs, see stats.c */
 };
 
-//static const unsigned int rates[] = { 44100, 48000, /* ?? 88200, */96000};
-/*static const struct snd_pcm_hw_constraint_list constraints_extra_rates = {
-	.count = ARRAY_SIZE(rates),
-	.list = rates,
-	.mask = 0,
-};*/
+static void sinn7_pcm_set_state(struct pcm_runtime *rt, u8 state)
+{
+	rt->stream_state = state;
+	trace_sinn7_stream_state(rt->chip->card->number, state);
+}
 
 static const struct snd_pcm_hardware pcm_hw = {
 	.info = SNDRV_PCM_INFO_MMAP |
 		SNDRV_PCM_INFO_INTERLEAVED |
 		//SNDRV_PCM_INFO_BLOCK_TRANSFER |
-		//SNDRV_PCM_INFO_PAUSE |
+		SNDRV_PCM_INFO_PAUSE |
 		SNDRV_PCM_INFO_MMAP_VALID,
-		//SNDRV_PCM_INFO_BATCH,
+		/* SNDRV_PCM_INFO_BATCH is added in sinn7_pcm_open for batching urbs */
 
-	.formats = SNDRV_PCM_FMTBIT_S16_LE,// | SNDRV_PCM_FMTBIT_S24_BE,
+	/* The device takes 24 bits, see encode.c for the conversion of each format */
+	.formats = SNDRV_PCM_FMTBIT_S16_LE |
+		SNDRV_PCM_FMTBIT_S24_3LE |
+		SNDRV_PCM_FMTBIT_S24_LE |
+		SNDRV_PCM_FMTBIT_S32_LE,
 
-	.rates = SNDRV_PCM_RATE_44100,// |
-		//SNDRV_PCM_RATE_48000 |
-		/* ?? SNDRV_PCM_RATE_88200 | */
-		//SNDRV_PCM_RATE_96000,
+	/* 176400 and 192000 are added in sinn7_pcm_open for extra_freq devices */
+	.rates = SNDRV_PCM_RATE_44100 |
+		SNDRV_PCM_RATE_48000 |
+		SNDRV_PCM_RATE_88200 |
+		SNDRV_PCM_RATE_96000,
 
 	.rate_min = 44100,
-	.rate_max = 44100,
-	//.rate_max = 96000,
+	.rate_max = 96000,
 	.channels_min = 2,
 	.channels_max = 2,
 	
@@ -104,169 +213,114 @@ static const struct snd_pcm_hardware pcm_hw = {
 	 * other periods and such
 	 */
 	
-	/* TODO: Change this value based on the FMT? Currently we picked
-	 * 24 bits to be able to send 250 Frames in 24bit mode. That
-	 * however means that we will have more frames in 16bit mode
-	 */
-	
 	.buffer_bytes_max = PCM_BUFFER_SIZE,
 	
 	// Frames * Byte pro Frame * # Channels
-	.period_bytes_min = 250 * 2 * 2, // 250 Frames (12800 Byte BULK Data)
-	.period_bytes_max = 390 * 2 * 2, // 390 Frames (19968 Byte BULK Data)
+	// The periods are independent of the urbs, see sinn7_pcm_urb_frames. The minimum
+	// of one block (in frames) is constrained in sinn7_pcm_open, as the frame size depends on the format
+	.period_bytes_min = PCM_BLOCK_FRAMES * 2 * 2, // 16 bit
+	.period_bytes_max = PCM_BUFFER_SIZE,
 	.periods_min = 1,
-	.periods_max = 200, // 166 periods equal 1 second
+	.periods_max = 1024,
 };
 
-void sinn7_timer_interrupt(unsigned long data);
+enum hrtimer_restart sinn7_timer_interrupt(struct hrtimer *timer);
+static void sinn7_flush_buffers(struct pcm_runtime *rt, struct pcm_urb *out_urb, ktime_t due);
+static int sinn7_pcm_setup_urbs(struct pcm_runtime *rt);
+static void sinn7_pcm_queue_fill(struct pcm_runtime *rt);
+static unsigned int sinn7_pcm_cfg_urbs(struct pcm_runtime *rt);
+static unsigned int sinn7_pcm_cfg_batch(struct pcm_runtime *rt);
+
+/* The device takes the usual UAC1 endpoint request (the same the probe uses to
+ * read the default rate): SET_CUR of the 3 byte sampling frequency on both
+ * endpoints. The rate is read back afterwards, as the device silently keeps
+ * its old rate when it doesn't like the new one.
+ */
+static int sinn7_chip_pcm_set_rate(struct pcm_runtime *rt, unsigned int rate)
+{
+	struct usb_device *device = rt->chip->dev;
+	static const u8 endpoints[] = { IN_EP, OUT_EP };
+	unsigned int current_rate;
+	u8 *buffer;
+	int ret;
+	int i;
 
-/* message values used to change the sample rate.
-TODO: Investigate the correct values */
-#define SINN7_SET_RATE_REQUEST 0xb0
+	if (rt->rate == rate)
+		return 0;
 
-#define SINN7_RATE_44100  0x43
-#define SINN7_RATE_48000  0x4b
-#define SINN7_RATE_88200  0x42
-#define SINN7_RATE_96000  0x4a
-#define SINN7_RATE_176400 0x40
-#define SINN7_RATE_192000 0x48
-#define SINN7_RATE_352800 0x58
-#define SINN7_RATE_384000 0x68
+	buffer = kmalloc(3, GFP_KERNEL); /* usb_control_msg needs dma-able memory */
+	if (!buffer)
+		return -ENOMEM;
 
-static inline size_t sinn7_framecount_to_buffersize(const uint32_t numFrames) {
-	/* See sinn7_frames_to_buffer for the calculation base */
-	return ((numFrames / 10) + (numFrames % 10 > 0 ? 1 : 0)) * PCM_BLOCK_SIZE;
-}
+	for (i = 0; i < ARRAY_SIZE(endpoints); i++) {
+		buffer[0] = rate;
+		buffer[1] = rate >> 8;
+		buffer[2] = rate >> 16;
+		ret = usb_control_msg(device, usb_sndctrlpipe(device, 0), UAC_SET_CUR,
+				      USB_TYPE_CLASS | USB_RECIP_ENDPOINT | USB_DIR_OUT,
+				      UAC_EP_CS_ATTR_SAMPLE_RATE << 8, endpoints[i],
+				      buffer, 3, USB_TIMEOUT);
+		if (ret < 0)
+			goto out;
+	}
 
-/**
- * This method converts a default PCM frame into an usb-ready sinn7 frame.
- * 
- * @param resultBuffer The Buffer to store the result at, offset to the correct position
- * @param frameBuffer The Buffer to read two frames of (left, right), offset to the correct position
- * @param bytesPerFrame The Number of bytes each frame consists of (equals to Bitness * 8).
- */
-static void sinn7_frame_to_buffer(void *resultBuffer, void *frameBuffer, uint8_t bytesPerFrame) {
-	/* For loop counters */
-	uint8_t i;
-	uint8_t j;
-	int8_t k;
-	
-	void *outBuffer; /* The buffer to store the usb data */
-	int32_t frame;
-	
-	for (i = 0; i < 2; i++) { /* Stereo */
-		if (bytesPerFrame == 2) {
-			const uint8_t frame_01 = *((uint8_t*)(frameBuffer + i * bytesPerFrame    ));
-			const uint8_t frame_02 = *((uint8_t*)(frameBuffer + i * bytesPerFrame + 1));
-			frame = le32_to_cpu(((frame_02 & 0xFF) << 8) | (frame_01 & 0xFF));
-		} else if (bytesPerFrame == 3) { /* Manual read since there is no uint24_t */
-			/* We read it as little endian, since most desktops run that,
-			 * so the conversion is only run on a minority of machines
-			 */
-			const uint8_t frame_01 = *((uint8_t*)(frameBuffer + i * bytesPerFrame    ));
-			const uint8_t frame_02 = *((uint8_t*)(frameBuffer + i * bytesPerFrame + 1));
-			const uint8_t frame_03 = *((uint8_t*)(frameBuffer + i * bytesPerFrame + 2));
-			
-			frame = le32_to_cpu(((frame_03 & 0xFF) << 16) | ((frame_02 & 0xFF) << 8) || (frame_01 & 0xFF));
-		} else {
-			printk("FATAL: Invalid bytesPerFrame=%d specified, Invalid Format.\n", bytesPerFrame);
-			return;
-		}
-			
-		
-		// Now we need to write the Frame as BIG ENDIAN and Encode the bits as bytes, so:
-		for (j = 0; j < 3; j++) { /* Per byte of frame. */
-			uint8_t byte = 0x0;
-			
-			if (bytesPerFrame == 3) { /* 24 bits */
-				if (j == 0) {
-					byte = (frame & 0xFF0000) >> 16; /* HIGH-Byte */
-				} else if (j == 1) {
-					byte = (frame & 0x00FF00) >> 8; /* MIDDLE-Byte */
-				} else {
-					byte = (frame & 0x0000FF); /* LOW-BYTE */
-				}
-			} else if (bytesPerFrame == 2) { /* 16 bits */
-				if (j == 0) {
-					byte = (frame & 0xFF00) >> 8; /* HIGH-Byte */
-				} else if (j == 1) {
-					byte = (frame & 0x00FF); /* LOW-BYTE */
-				} else {
-					byte = 0x0;
-				}
-			}
-			
-			outBuffer = (resultBuffer + i * 3 * 8 + j * 8);
-			
-			for (k = 7; k >= 0; k--) {
-				memset(outBuffer, (byte & (1 << k)) != 0 ? 0x1 : 0x0, 1);
-				outBuffer++;
-			}
-        }
+	ret = usb_control_msg(device, usb_rcvctrlpipe(device, 0), UAC_GET_CUR,
+			      USB_TYPE_CLASS | USB_RECIP_ENDPOINT | USB_DIR_IN,
+			      UAC_EP_CS_ATTR_SAMPLE_RATE << 8, IN_EP,
+			      buffer, 3, USB_TIMEOUT);
+	if (ret < 0)
+		goto out;
+
+	current_rate = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16);
+	if (ret != 3 || current_rate != rate) {
+		dev_err(&device->dev, "cannot set the rate to %u, the device runs at %u\n",
+			rate, current_rate);
+		ret = -EINVAL;
+		goto out;
 	}
+
+	dev_dbg(&device->dev, "rate set to %u\n", rate);
+	rt->rate = rate;
+	rt->drift_ppb = 0; /* the rates may come from different crystals */
+	atomic_set(&rt->stats.drift_ppb, 0);
+	ret = 0;
+out:
+	if (ret < 0 && ret != -EINVAL)
+		dev_err(&device->dev, "setting the rate to %u failed: %d\n", rate, ret);
+	kfree(buffer);
+	return ret;
 }
 
-/**
- * This method converts a default PCM sequence into an usb-ready buffer to be used with the SINN7 Interface.
- * 
- * @param frameBuffer The Address where the frames are stored. It's size has to equal numFrames * bytesPerFrame * 2
- * @param numFrames The Number of frames in the framebuffer.
- * @param bytesPerFrame The Number of bytes each frame consists of (Equal to Bitness * 8). Has to be 2 currently.
- * @return An usb-ready buffer to be sent to the interface.
+/* The urbs take the frames from the alsa ring buffer regardless of the period
+ * size: As many as the device takes best, but not more than a period, so each
+ * urb holds at most one period boundary. Always whole blocks, a partial block
+ * would be padded with silence.
+ * Batching urbs pack several transfers and may span periods instead.
+ * All urbs can be in flight at once (the fill worker takes a whole ring of
+ * them at the start), so each takes at most 1 / (n_urbs + 1) of the ring
+ * buffer: The urbs never reach frames the application didn't write yet. The
+ * buffer holds at least n_urbs + 1 blocks, see sinn7_pcm_open.
  */
-static void *sinn7_frames_to_buffer(void *frameBuffer, uint32_t numFrames, uint8_t bytesPerFrame)
+static snd_pcm_uframes_t sinn7_pcm_urb_frames(struct pcm_runtime *rt, struct snd_pcm_runtime *alsa_rt)
 {
-	uint32_t blockId;
-	//Note: xyzBytesPerFrame is on a per Channel Base, so we need to multiply it by 2, since we're in stereo mode.
-	const uint8_t outputBytesPerFrame = 24; // Even in 16bit mode, we output 24bit (And yes, here 1 Bit == 1 Device Byte)
-	const uint8_t paddingFrameSize = 32; // After 10 Frames, we have to pad with these bytes.
-	const uint32_t blockSize = outputBytesPerFrame * 2 * 10 + paddingFrameSize;
-	
-	const uint32_t numOfBlocks = (numFrames / 10) + (numFrames % 10 > 0 ? 1 : 0); // Each "Block" contains 10 Frames and ends with a Padding Frame
-	const size_t outputBufferSize = numOfBlocks * blockSize;
+	const snd_pcm_uframes_t share = rounddown(alsa_rt->buffer_size / (rt->n_urbs + 1), PCM_BLOCK_FRAMES);
+	snd_pcm_uframes_t frames = rt->urb_frames_max * PCM_RATE_FACTOR(alsa_rt->rate);
 
-	void *buf = kzalloc(outputBufferSize, GFP_ATOMIC);
-	
-	for (blockId = 0; blockId < numOfBlocks; blockId++) {
-		uint8_t frameId;
-		uint8_t currentFrames;
-		
-		currentFrames = (numFrames - blockId * blockSize) > 10 ? 10 : (numFrames - blockId * blockSize);
-		
-		for (frameId = 0; frameId < currentFrames; frameId++) {
-			sinn7_frame_to_buffer((void*)(buf + blockId * blockSize + frameId * outputBytesPerFrame * 2),
-					      (frameBuffer + blockId * bytesPerFrame * 2 * 10 + frameId * bytesPerFrame * 2),
-					      bytesPerFrame);
-		}
-		
-		memset(buf + blockId * blockSize + 10 * outputBytesPerFrame * 2    , 0xFD, 1 );
-		memset(buf + blockId * blockSize + 10 * outputBytesPerFrame * 2 + 1, 0xFF, 1 );
-		memset(buf + blockId * blockSize + 10 * outputBytesPerFrame * 2 + 2, 0x00, 30);
-	}
-	
-	return buf;
-}
+	if (rt->batch > 1)
+		frames *= rt->batch;
+	else if (alsa_rt->period_size < frames)
+		frames = rounddown(alsa_rt->period_size, PCM_BLOCK_FRAMES);
 
-/**
- * This method converts a default PCM sequence into an usb-ready buffer to be used with the SINN7 Interface.
- *  
- * @param frameBuffer The Address where the frames are stored. It's size has to equal numFrames * bytesPerFrame * 2
- * @param numFrames The Number of frames in the framebuffer.
- * @param bytesPerFrame The Number of bytes each frame consists of (Equal to Bitness * 8). Has to be 2 currently.
- * @param targetBuffer The Buffer for the output data
- */
-static void sinn7_frames_to_buffer_ex(void *frameBuffer, uint32_t numFrames, uint8_t bytesPerFrame, void *targetBuffer)
-{
-	void *buf;
-	buf = sinn7_frames_to_buffer(frameBuffer, numFrames, bytesPerFrame);
-	memcpy(targetBuffer, buf, sinn7_framecount_to_buffersize(numFrames));
-	kfree(buf);
+	return max_t(snd_pcm_uframes_t, PCM_BLOCK_FRAMES, min(frames, share));
 }
 
-static int sinn7_chip_pcm_set_rate(struct pcm_runtime *rt, unsigned int rate)
+/* The in urbs are sized for the capture buffer once the capture is prepared,
+ * the playback's urbs might not fit into it. Before that the data is dropped
+ * anyway, so they follow the playback.
+ */
+static snd_pcm_uframes_t sinn7_pcm_in_urb_frames(struct pcm_runtime *rt)
 {
-	dev_warn(&rt->chip->dev->dev, "Call to unimplemented method sinn7_chip_pcm_set_rate!\n");
-	return 0; /* TODO: Implement */
+	return READ_ONCE(rt->in_urb_frames) ?: rt->urb_frames;
 }
 
 static struct pcm_substream *sinn7_pcm_get_substream(struct snd_pcm_substream *alsa_sub)
@@ -280,6 +334,10 @@ static struct pcm_substream *sinn7_pcm_get_substream(struct snd_pcm_substream *a
 	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK) {
 		return &rt->playback;
 	}
+	
+	if (alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		return &rt->capture;
+	}
 
 	dev_err(device, "Error getting pcm substream slot.\n");
 	return NULL;
@@ -288,27 +346,23 @@ static struct pcm_substream *sinn7_pcm_get_substream(struct snd_pcm_substream *a
 /* call with stream_mutex locked */
 static void sinn7_pcm_stream_stop(struct pcm_runtime *rt)
 {
-	int i, time;
+	int i;
 	
-	if (rt->timer != 0x0) {
-		del_timer_sync(rt->timer);
-		kfree(rt->timer);
-		rt->timer = 0x0;
-	}
+	hrtimer_cancel(&rt->timer);
 
 	if (rt->stream_state != STREAM_DISABLED) {
-		rt->stream_state = STREAM_STOPPING;
-
-		for (i = 0; i < PCM_N_URBS; i++) {
-			time = usb_wait_anchor_empty_timeout(&rt->out_urbs[i].submitted, 100);
-			if (!time) {
-				usb_kill_anchored_urbs(
-					&rt->out_urbs[i].submitted);
-			}
-			usb_kill_urb(&rt->out_urbs[i].instance);
-		}
-
-		rt->stream_state = STREAM_DISABLED;
+		sinn7_pcm_set_state(rt, STREAM_STOPPING);
+		cancel_work_sync(&rt->fill_work);
+
+		/* The queued audio gets 100 ms to play out */
+		if (!usb_wait_anchor_empty_timeout(&rt->out_anchor, 100))
+			usb_kill_anchored_urbs(&rt->out_anchor);
+		for (i = 0; i < rt->n_urbs; i++)
+			usb_kill_urb(&rt->in_urbs[i].instance);
+		/* An out completion may have queued the worker again meanwhile */
+		cancel_work_sync(&rt->fill_work);
+
+		sinn7_pcm_set_state(rt, STREAM_DISABLED);
 	}
 }
 
@@ -316,25 +370,76 @@ static void sinn7_pcm_stream_stop(struct pcm_runtime *rt)
 static int sinn7_pcm_stream_start(struct pcm_runtime *rt)
 {
 	int ret = 0;
-	size_t bufSize;
-	void *zeroFrames; /* Represents silence as audio */
-	void *buffer;
+	int i;
 
 	if (rt->stream_state == STREAM_DISABLED) {
 		/* reset panic state when starting a new stream */
 		rt->panic = false;
+		rt->failed = false;
+		/* The device refuses a stalled endpoint until the host clears it */
+		if (rt->out_halted) {
+			rt->out_halted = false;
+			usb_clear_halt(rt->chip->dev, usb_sndbulkpipe(rt->chip->dev, OUT_EP));
+		}
+		if (rt->in_halted) {
+			rt->in_halted = false;
+			usb_clear_halt(rt->chip->dev, usb_rcvbulkpipe(rt->chip->dev, IN_EP));
+		}
+		rt->streaming = streaming;
+		rt->stream_wait_cond = false;
+		atomic_set(&rt->in_flight, 0);
+		atomic_set(&rt->playback.queued, 0);
+		atomic64_set(&rt->playback.completed, 0);
+		atomic64_set(&rt->capture.completed, 0);
+		rt->drift_start = ktime_set(0, 0);
+		bitmap_fill(rt->idle_urbs, rt->n_urbs);
+		bitmap_zero(rt->parked_in, PCM_N_URBS_MAX);
+		atomic_set(&rt->timer_parked, 0);
 		/* submit our out urbs zero init */
-		rt->stream_state = STREAM_STARTING;
+		sinn7_pcm_set_state(rt, STREAM_STARTING);
 		
-		/* Play 250 Frames of silence */
-		bufSize = sinn7_framecount_to_buffersize(250);
-		zeroFrames = kzalloc(250 * 2 * 2, GFP_ATOMIC);
-		buffer = sinn7_frames_to_buffer(zeroFrames, 250, 2);
-		kfree(zeroFrames);
+		/* The device sends its input as long as the stream runs, the in urbs
+		 * are resubmitted by their completion handler in any mode.
+		 */
+		for (i = 0; i < rt->n_urbs; i++) {
+			rt->in_urbs[i].instance.transfer_buffer_length =
+				sinn7_framecount_to_buffersize(sinn7_pcm_in_urb_frames(rt));
+			rt->in_urbs[i].dma_off = 0;
+			trace_sinn7_urb_submit(false, i, rt->in_urbs[i].instance.transfer_buffer_length, 0);
+			ret = usb_submit_urb(&rt->in_urbs[i].instance, GFP_KERNEL);
+			if (ret) {
+				atomic_long_inc(&rt->stats.submit_errors);
+				dev_err(&rt->chip->dev->dev, "%s: cannot submit in urb: %d\n", __func__, ret);
+				sinn7_pcm_stream_stop(rt);
+				return ret;
+			}
+			atomic_long_inc(&rt->stats.in_submitted);
+		}
+		
+		if (rt->streaming) {
+			/* A single urb of silence shows that the device takes data. The
+			 * others stay idle, so at TRIGGER_START the fill worker pre-rolls
+			 * the audio into all of them instead of queueing it behind
+			 * silence. While nothing runs the engine parks after this urb.
+			 */
+			for (i = 0; i < rt->n_urbs; i++)
+				rt->out_urbs[i].due = ktime_set(0, 0);
+			clear_bit(0, rt->idle_urbs);
+			sinn7_flush_buffers(rt, &rt->out_urbs[0], ktime_set(0, 0));
+			
+			/* wait for the device to consume the first urb */
+			wait_event_timeout(rt->stream_wait_queue,
+					   rt->stream_wait_cond || rt->panic || rt->failed, HZ);
+			if (!rt->stream_wait_cond) {
+				dev_err(&rt->chip->dev->dev, "%s: device did not consume any data\n", __func__);
+				sinn7_pcm_stream_stop(rt);
+				return -EIO;
+			}
+		}
 		
 		dev_dbg(&rt->chip->dev->dev, "%s: Stream is running wakeup event\n",
 			__func__);
-		rt->stream_state = STREAM_RUNNING;
+		sinn7_pcm_set_state(rt, STREAM_RUNNING);
 		
 		return 0;
 	}
@@ -342,74 +447,319 @@ static int sinn7_pcm_stream_start(struct pcm_runtime *rt)
 	return ret;
 }
 
-/* call with substream locked */
-/* returns true if a period elapsed */
-static bool sinn7_pcm_playback(struct pcm_substream *sub, struct pcm_urb *urb)
+/* Publishes the position after numFrames more frames, see sinn7_pcm_pointer.
+ * Each direction has a single writer: the fill worker for the playback and the
+ * in urb completion for the capture (and prepare, while they are stopped).
+ * The interrupts are off, so no reader on this cpu can spin on the writer.
+ * returns true if a period elapsed */
+static bool sinn7_pcm_publish(struct pcm_substream *sub, snd_pcm_uframes_t dma_off,
+			      snd_pcm_uframes_t numFrames, snd_pcm_uframes_t period_size)
+{
+	unsigned long flags;
+	bool elapsed = false;
+
+	local_irq_save(flags);
+	write_seqcount_begin(&sub->pos_seq);
+	sub->dma_off = dma_off;
+	/* Without batching the urb holds at most one period boundary, see
+	 * sinn7_pcm_urb_frames. Otherwise alsa catches up on all elapsed periods.
+	 */
+	sub->period_off += numFrames;
+	if (sub->period_off >= period_size) {
+		sub->period_off %= period_size;
+		elapsed = true;
+	}
+	write_seqcount_end(&sub->pos_seq);
+	local_irq_restore(flags);
+	return elapsed;
+}
+
+/* Fills the urb with the next numFrames frames of the alsa ring buffer, which
+ * start at dma_off. The position only moves on after the encoding, as the fill
+ * worker is its only writer.
+ * returns true if a period elapsed */
+static bool sinn7_pcm_playback(struct pcm_substream *sub, struct pcm_urb *urb,
+			       snd_pcm_uframes_t dma_off, snd_pcm_uframes_t numFrames)
 {
 	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
 	struct device *device = &urb->chip->dev->dev;
+	struct sinn7_stats *stats = &urb->chip->pcm->stats;
+	const struct sinn7_encoder *encoder = urb->chip->pcm->encoder;
+	const ktime_t encode_start = ktime_get();
 	u8 *source;
 	unsigned int pcm_buffer_size;
-	size_t period_bytes;
+	size_t chunk_bytes;
+	s64 encode_ns;
 	
-	period_bytes = frames_to_bytes(alsa_rt, alsa_rt->period_size); /* The chunk we process */
+	chunk_bytes = frames_to_bytes(alsa_rt, numFrames); /* The chunk we process */
 
-	WARN_ON(alsa_rt->format != SNDRV_PCM_FORMAT_S16_LE);
 	pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
 
-	if (sub->dma_off + period_bytes <= pcm_buffer_size) {
+	trace_sinn7_urb_fill(true, urb->index, sinn7_framecount_to_buffersize(numFrames), dma_off);
+	trace_sinn7_encode_start(true, urb->index, chunk_bytes, dma_off);
+	encoder = sinn7_encoder_begin(encoder);
+
+	/* The frames are encoded straight from the dma_area into the urb buffer */
+	if (dma_off + chunk_bytes <= pcm_buffer_size) {
 		dev_dbg(device, "%s: (1) buffer_size %#x dma_offset %#x\n", __func__,
 			 (unsigned int) pcm_buffer_size,
-			 (unsigned int) sub->dma_off);
+			 (unsigned int) dma_off);
 
-		source = alsa_rt->dma_area + sub->dma_off;
-		memcpy(urb->buffer, source, period_bytes);
+		source = alsa_rt->dma_area + dma_off;
+		sinn7_frames_to_buffer(urb->buffer, 0, source, numFrames, sub->format, encoder);
 	} else {
 		/* wrap around at end of ring buffer */
-		unsigned int len;
+		snd_pcm_uframes_t len;
 
 		dev_dbg(device, "%s: (2) buffer_size %#x dma_offset %#x\n", __func__,
 			 (unsigned int) pcm_buffer_size,
-			 (unsigned int) sub->dma_off);
+			 (unsigned int) dma_off);
 
-		len = pcm_buffer_size - sub->dma_off;
+		len = bytes_to_frames(alsa_rt, pcm_buffer_size - dma_off);
 
-		source = alsa_rt->dma_area + sub->dma_off;
-		memcpy(urb->buffer, source, len);
+		source = alsa_rt->dma_area + dma_off;
+		sinn7_frames_to_buffer(urb->buffer, 0, source, len, sub->format, encoder);
 
 		source = alsa_rt->dma_area;
-		memcpy(urb->buffer + len, source, period_bytes - len);
+		sinn7_frames_to_buffer(urb->buffer, len, source, numFrames - len, sub->format, encoder);
 	}
+	sinn7_finish_buffer(urb->buffer, numFrames);
 	
-	sub->dma_off += period_bytes;
-	if (sub->dma_off >= pcm_buffer_size) {
-		sub->dma_off -= pcm_buffer_size;
+	sinn7_encoder_end(encoder);
+	trace_sinn7_encode_end(true, urb->index, chunk_bytes, dma_off);
+	
+	encode_ns = ktime_to_ns(ktime_sub(ktime_get(), encode_start));
+	atomic_long_inc(&stats->encodes);
+	atomic_long_add(encode_ns, &stats->encode_ns);
+	sinn7_stats_time(stats->encode_time, encode_ns);
+	
+	dma_off += chunk_bytes;
+	if (dma_off >= pcm_buffer_size) {
+		dma_off -= pcm_buffer_size;
 	}
+	return sinn7_pcm_publish(sub, dma_off, numFrames, alsa_rt->period_size);
+}
 
-	sub->period_off += alsa_rt->period_size;
-	if (sub->period_off >= alsa_rt->period_size) {
-		sub->period_off %= alsa_rt->period_size;
-		return true;
+/* Copies the frames of a completed in urb to the alsa dma_area.
+ * returns true if a period elapsed */
+static bool sinn7_pcm_capture(struct pcm_substream *sub, struct pcm_urb *urb, unsigned int length)
+{
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+	const struct sinn7_encoder *encoder = urb->chip->pcm->encoder;
+	unsigned int pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
+	uint32_t numFrames = (length / PCM_BLOCK_SIZE) * PCM_BLOCK_FRAMES; /* the device sends whole blocks */
+	uint32_t frameIndex = 0;
+	snd_pcm_uframes_t dma_off = sub->dma_off;
+	
+	/* An urb submitted before the prepare may be larger than the buffer
+	 * allows, the rest of it is dropped
+	 */
+	numFrames = min_t(uint32_t, numFrames, sinn7_pcm_in_urb_frames(urb->chip->pcm));
+	if (!numFrames)
+		return false;
+	
+	encoder = sinn7_encoder_begin(encoder);
+	
+	while (frameIndex < numFrames) {
+		/* wrap around at end of ring buffer */
+		const uint32_t len = min_t(uint32_t, numFrames - frameIndex,
+					   bytes_to_frames(alsa_rt, pcm_buffer_size - dma_off));
+		
+		sinn7_buffer_to_frames(alsa_rt->dma_area + dma_off, urb->buffer, frameIndex, len, sub->format, encoder);
+		frameIndex += len;
+		
+		dma_off += frames_to_bytes(alsa_rt, len);
+		if (dma_off >= pcm_buffer_size) {
+			dma_off -= pcm_buffer_size;
+		}
 	}
-	return false;
+	
+	sinn7_encoder_end(encoder);
+	
+	return sinn7_pcm_publish(sub, dma_off, numFrames, alsa_rt->period_size);
+}
+
+/* Neither direction moves audio or is paused, so the engine parks: the timer
+ * stops, the completed urbs aren't refilled or resubmitted. sinn7_pcm_wake
+ * restarts it. A paused substream keeps the engine going with silence, so the
+ * release doesn't wait for anything.
+ * The parking sides mark what they park first and check again afterwards,
+ * sinn7_pcm_wake sets active first and checks the marks afterwards, so one
+ * of them always sees the other.
+ */
+static bool sinn7_pcm_idle(struct pcm_runtime *rt)
+{
+	return !READ_ONCE(rt->playback.active) && !READ_ONCE(rt->playback.paused) &&
+	       !READ_ONCE(rt->capture.active) && !READ_ONCE(rt->capture.paused);
+}
+
+/* The duration of an urb by the device clock, for the timer pacing. The out
+ * completions update it while the timer reads it, atomic64 keeps it in one
+ * piece on 32 bit.
+ */
+static void sinn7_pcm_update_pacing(struct pcm_runtime *rt)
+{
+	const s64 ns = div_u64((u64)rt->urb_frames * NSEC_PER_SEC, rt->rate);
+
+	atomic64_set(&rt->urb_ns, ns - div_s64(ns * rt->drift_ppb, NSEC_PER_SEC));
+}
+
+/* Half an urb, so the queue is topped up in time */
+static ktime_t sinn7_pcm_timer_interval(struct pcm_runtime *rt)
+{
+	return ns_to_ktime(atomic64_read(&rt->urb_ns) >> 1);
+}
+
+/* Called by the out urb completions only, which don't run concurrently */
+/* Measures the rate the device consumes the out urbs at. A drained queue
+ * left the device waiting for data, so the window starts over.
+ */
+static void sinn7_pcm_track_drift(struct pcm_runtime *rt, struct pcm_urb *urb,
+				  ktime_t now, bool drained)
+{
+	s64 ns, diff, ppb;
+
+	if (drained || !rt->rate) {
+		rt->drift_start = ktime_set(0, 0);
+		return;
+	}
+	if (!ktime_to_ns(rt->drift_start)) {
+		/* the frames of this urb were consumed before the window */
+		rt->drift_start = now;
+		rt->drift_frames = 0;
+		return;
+	}
+
+	rt->drift_frames += urb->frames;
+	ns = ktime_to_ns(ktime_sub(now, rt->drift_start));
+	if (ns < PCM_DRIFT_WINDOW)
+		return;
+
+	/* (frames / ns - rate) / rate, scaled to ppb */
+	diff = (s64)rt->drift_frames * NSEC_PER_SEC - (s64)rt->rate * ns;
+	ppb = div64_s64(diff * 1000, (s64)rt->rate * div_s64(ns, NSEC_PER_MSEC));
+	rt->drift_start = now;
+	rt->drift_frames = 0;
+	if (ppb > PCM_DRIFT_MAX || ppb < -PCM_DRIFT_MAX || ns > 2 * PCM_DRIFT_WINDOW)
+		return;
+
+	rt->drift_ppb += (int)(ppb - rt->drift_ppb) / PCM_DRIFT_WEIGHT;
+	atomic_set(&rt->stats.drift_ppb, rt->drift_ppb);
+	if (!rt->streaming)
+		sinn7_pcm_update_pacing(rt);
+}
+
+/* Timer pacing: Adapts the number of queued urbs to how in time the completions arrive */
+static void sinn7_pcm_adapt_lead(struct pcm_runtime *rt, bool drained)
+{
+	const ktime_t now = ktime_get();
+	const s64 period_ns = atomic64_read(&rt->urb_ns);
+	const s64 gap_ns = ktime_to_ns(ktime_sub(now, rt->last_completion));
+	
+	rt->last_completion = now;
+	if (!rt->playback.active)
+		return; /* nothing is queued on purpose */
+	
+	if (drained || gap_ns > period_ns + (period_ns >> 1)) {
+		/* The device ran (or almost ran) out of data */
+		if (rt->lead < rt->n_urbs)
+			rt->lead++;
+		rt->on_time = 0;
+	} else if (++rt->on_time >= PCM_LEAD_SETTLE) {
+		if (rt->lead > PCM_LEAD_MIN)
+			rt->lead--;
+		rt->on_time = 0;
+	}
+}
+
+/* Stops a failed stream: ALSA sees an xrun, so the applications prepare
+ * their substreams again, which starts the stream over.
+ * call with stream_mutex locked */
+static void sinn7_pcm_stop_failed(struct pcm_runtime *rt)
+{
+	if (rt->playback.instance)
+		snd_pcm_stop_xrun(rt->playback.instance);
+	if (rt->capture.instance)
+		snd_pcm_stop_xrun(rt->capture.instance);
+	sinn7_pcm_stream_stop(rt);
+}
+
+static void sinn7_pcm_error_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(work, struct pcm_runtime, error_work);
+
+	mutex_lock(&rt->stream_mutex);
+	if (rt->failed && !rt->panic && rt->stream_state != STREAM_DISABLED)
+		sinn7_pcm_stop_failed(rt);
+	mutex_unlock(&rt->stream_mutex);
+}
+
+/* An urb failed or couldn't be submitted. A device which is gone ends the
+ * pcm for good. Anything else (a stall, a protocol error, ...) would most
+ * likely come right back, so the urbs aren't refilled or resubmitted anymore
+ * and sinn7_pcm_error_work stops the stream.
+ */
+static void sinn7_pcm_urb_failed(struct pcm_runtime *rt, bool out, int status)
+{
+	if (status == -ENODEV || status == -ESHUTDOWN) {
+		rt->panic = true;
+		dev_err(&rt->chip->dev->dev, "PANIC!\n");
+		return;
+	}
+
+	if (status == -EPIPE) {
+		if (out)
+			rt->out_halted = true;
+		else
+			rt->in_halted = true;
+	}
+	rt->failed = true;
+	wake_up(&rt->stream_wait_queue); /* a starting stream gives up right away */
+	schedule_work(&rt->error_work);
 }
 
 static void sinn7_pcm_out_urb_handler(struct urb *usb_urb)
 {
+	const ktime_t now = ktime_get();
 	struct pcm_urb *out_urb;
 	struct pcm_runtime *rt;
+	bool drained;
 	
 	out_urb = usb_urb->context;
 	rt = out_urb->chip->pcm;
+	drained = atomic_dec_return(&rt->in_flight) == 0;
+	trace_sinn7_urb_complete(true, out_urb->index, usb_urb->actual_length, out_urb->dma_off);
+	atomic_long_inc(&rt->stats.out_completed);
+	/* The handshake urb and parking drain the queue on purpose */
+	if (drained && READ_ONCE(rt->playback.active) && rt->stream_state == STREAM_RUNNING)
+		atomic_long_inc(&rt->stats.drained);
+
+	atomic_sub(out_urb->frames, &rt->playback.queued);
+	atomic64_set(&rt->playback.completed, ktime_to_ns(now));
+	if (out_urb->start_ns) {
+		/* The device took the first frames after the start */
+		const s64 latency = ktime_to_ns(now) - out_urb->start_ns;
+
+		out_urb->start_ns = 0;
+		sinn7_stats_time(rt->stats.start_latency, latency);
+		trace_sinn7_start_done(rt->chip->card->number, latency);
+	}
+	if (usb_urb->status == 0)
+		sinn7_pcm_track_drift(rt, out_urb, now, drained);
 
-	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+	if (rt->panic || rt->failed || rt->stream_state == STREAM_STOPPING)
 		return;
 
-	if (unlikely(usb_urb->status == -ENOENT ||	/* unlinked */
-		     usb_urb->status == -ENODEV ||	/* device removed */
-		     usb_urb->status == -ECONNRESET ||	/* unlinked */
-		     usb_urb->status == -ESHUTDOWN)) {	/* device disabled */
-		goto out_fail;
+	if (unlikely(usb_urb->status)) {
+		if (usb_urb->status != -ENOENT &&	/* unlinked */
+		    usb_urb->status != -ECONNRESET &&	/* unlinked */
+		    usb_urb->status != -ENODEV &&	/* device removed */
+		    usb_urb->status != -ESHUTDOWN) {	/* device disabled */
+			atomic_long_inc(&rt->stats.urb_errors);
+			dev_err(&rt->chip->dev->dev, "out urb failed: %d\n", usb_urb->status);
+		}
+		sinn7_pcm_urb_failed(rt, true, usb_urb->status);
+		return;
 	}
 
 	if (rt->stream_state == STREAM_STARTING) {
@@ -417,11 +767,141 @@ static void sinn7_pcm_out_urb_handler(struct urb *usb_urb)
 		wake_up(&rt->stream_wait_queue);
 	}
 	
-	return;
-    
-out_fail:
-	rt->panic = true;
-	printk("PANIC!\n");
+	/* The fill worker sees the time before the idle bit */
+	out_urb->due = now;
+	smp_mb__before_atomic();
+	set_bit(out_urb->index, rt->idle_urbs);
+
+	if (rt->streaming) {
+		/* The device consumed this urb, so it can take the next chunk right away */
+		smp_mb__after_atomic();
+		if (!sinn7_pcm_idle(rt))
+			sinn7_pcm_queue_fill(rt);
+	} else {
+		sinn7_pcm_adapt_lead(rt, drained);
+	}
+}
+
+/* Resubmits a completed in urb. Returns < 0 if the submission failed */
+static int sinn7_pcm_submit_in(struct pcm_runtime *rt, struct pcm_urb *in_urb)
+{
+	int ret;
+
+	in_urb->dma_off = rt->capture.dma_off;
+	in_urb->instance.transfer_buffer_length = sinn7_framecount_to_buffersize(sinn7_pcm_in_urb_frames(rt));
+	trace_sinn7_urb_submit(false, in_urb->index, in_urb->instance.transfer_buffer_length, in_urb->dma_off);
+	ret = usb_submit_urb(&in_urb->instance, GFP_ATOMIC);
+	if (ret < 0) {
+		if (rt->stream_state == STREAM_STOPPING)
+			return 0; /* the urb is being killed, it refuses resubmission */
+
+		atomic_long_inc(&rt->stats.submit_errors);
+		dev_warn(&rt->chip->dev->dev, "usb_submit_urb returned %d\n", ret);
+		return ret;
+	}
+	atomic_long_inc(&rt->stats.in_submitted);
+	return 0;
+}
+
+static void sinn7_pcm_in_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *in_urb = usb_urb->context;
+	struct pcm_runtime *rt = in_urb->chip->pcm;
+	struct pcm_substream *sub = &rt->capture;
+	bool do_period_elapsed = false;
+	int ret;
+
+	trace_sinn7_urb_complete(false, in_urb->index, usb_urb->actual_length, in_urb->dma_off);
+	atomic_long_inc(&rt->stats.in_completed);
+
+	if (rt->panic || rt->failed || rt->stream_state == STREAM_STOPPING)
+		return;
+
+	/* Like the out urbs: Resubmitting a failed urb (e.g. -EPROTO while the
+	 * device is unplugged) would loop right here in the completion.
+	 */
+	if (unlikely(usb_urb->status)) {
+		if (usb_urb->status != -ENOENT &&	/* unlinked */
+		    usb_urb->status != -ECONNRESET &&	/* unlinked */
+		    usb_urb->status != -ENODEV &&	/* device removed */
+		    usb_urb->status != -ESHUTDOWN) {	/* device disabled */
+			atomic_long_inc(&rt->stats.urb_errors);
+			dev_err(&rt->chip->dev->dev, "in urb failed: %d\n", usb_urb->status);
+		}
+		sinn7_pcm_urb_failed(rt, false, usb_urb->status);
+		return;
+	}
+
+	atomic64_set(&sub->completed, ktime_get_ns());
+
+	/* Announced before active is read, see sinn7_pcm_sync_capture */
+	atomic_inc(&sub->decoding);
+	smp_mb__after_atomic();
+	if (READ_ONCE(sub->active))
+		do_period_elapsed = sinn7_pcm_capture(sub, in_urb, usb_urb->actual_length);
+
+	if (do_period_elapsed) {
+		trace_sinn7_period_elapsed(false, sub->dma_off);
+		snd_pcm_period_elapsed(sub->instance);
+	}
+	if (atomic_dec_and_test(&sub->decoding) && waitqueue_active(&rt->stream_wait_queue))
+		wake_up(&rt->stream_wait_queue);
+
+	if (sinn7_pcm_idle(rt)) {
+		set_bit(in_urb->index, rt->parked_in);
+		smp_mb__after_atomic();
+		if (sinn7_pcm_idle(rt) || !test_and_clear_bit(in_urb->index, rt->parked_in))
+			return; /* parked, or sinn7_pcm_wake took it meanwhile */
+	}
+
+	ret = sinn7_pcm_submit_in(rt, in_urb);
+	if (ret < 0)
+		sinn7_pcm_urb_failed(rt, false, ret);
+}
+
+/* Waits until no in urb completion decodes into the capture buffer anymore,
+ * call after clearing active. The urbs keep going for the playback, so unlike
+ * the fill worker they can't be flushed. A completion either sees active
+ * cleared or is seen in decoding.
+ */
+static void sinn7_pcm_sync_capture(struct pcm_runtime *rt)
+{
+	smp_mb();
+	wait_event(rt->stream_wait_queue, !atomic_read(&rt->capture.decoding));
+}
+
+/* The substream sharing the device stream with sub */
+static struct pcm_substream *sinn7_pcm_other_substream(struct pcm_runtime *rt,
+							struct pcm_substream *sub)
+{
+	return sub == &rt->playback ? &rt->capture : &rt->playback;
+}
+
+/* Restarts the engine parked by sinn7_pcm_idle, call after setting active.
+ * The fill worker sends the first urb right away, so the audio starts within a period.
+ */
+static void sinn7_pcm_wake(struct pcm_runtime *rt)
+{
+	int i, ret;
+
+	smp_mb(); /* see sinn7_pcm_idle */
+	if (rt->panic || rt->failed || rt->stream_state != STREAM_RUNNING)
+		return;
+
+	for (i = 0; i < rt->n_urbs; i++) {
+		if (!test_and_clear_bit(i, rt->parked_in))
+			continue;
+		ret = sinn7_pcm_submit_in(rt, &rt->in_urbs[i]);
+		if (ret < 0) {
+			sinn7_pcm_urb_failed(rt, false, ret);
+			return;
+		}
+	}
+
+	if (rt->streaming)
+		sinn7_pcm_queue_fill(rt);
+	else if (atomic_xchg(&rt->timer_parked, 0))
+		hrtimer_start(&rt->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
 }
 
 static int sinn7_pcm_open(struct snd_pcm_substream *alsa_sub)
@@ -429,6 +909,8 @@ static int sinn7_pcm_open(struct snd_pcm_substream *alsa_sub)
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
 	struct pcm_substream *sub = NULL;
 	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	unsigned int n_urbs;
+	int ret;
 
 	if (rt->panic)
 		return -EPIPE;
@@ -436,8 +918,35 @@ static int sinn7_pcm_open(struct snd_pcm_substream *alsa_sub)
 	mutex_lock(&rt->stream_mutex);
 	alsa_rt->hw = pcm_hw;
 
+	if (rt->extra_freq) {
+		alsa_rt->hw.rates |= SNDRV_PCM_RATE_176400 | SNDRV_PCM_RATE_192000;
+		alsa_rt->hw.rate_max = 192000;
+	}
+
+	/* An urb takes at least one block, but never more than a period */
+	ret = snd_pcm_hw_constraint_minmax(alsa_rt, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+					   PCM_BLOCK_FRAMES, UINT_MAX);
+	if (ret < 0) {
+		mutex_unlock(&rt->stream_mutex);
+		return ret;
+	}
+
+	/* All urbs in flight and one more block still fit into the buffer, see
+	 * sinn7_pcm_urb_frames. The urbs of a stopped stream are set up by the
+	 * prepare, with the current configuration.
+	 */
+	n_urbs = rt->stream_state != STREAM_DISABLED ? rt->n_urbs : sinn7_pcm_cfg_urbs(rt);
+	ret = snd_pcm_hw_constraint_minmax(alsa_rt, SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+					   (n_urbs + 1) * PCM_BLOCK_FRAMES, UINT_MAX);
+	if (ret < 0) {
+		mutex_unlock(&rt->stream_mutex);
+		return ret;
+	}
+
 	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK)
 		sub = &rt->playback;
+	else if (alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE)
+		sub = &rt->capture;
 
 	if (!sub) {
 		struct device *device = &rt->chip->dev->dev;
@@ -446,8 +955,24 @@ static int sinn7_pcm_open(struct snd_pcm_substream *alsa_sub)
 		return -EINVAL;
 	}
 
+	/* A batching urb spans several periods, so the pointer jumps by more than
+	 * a period and the delay can't be interpolated within the urb.
+	 */
+	if ((rt->stream_state != STREAM_DISABLED ? rt->batch : sinn7_pcm_cfg_batch(rt)) > 1)
+		alsa_rt->hw.info |= SNDRV_PCM_INFO_BATCH;
+
+	/* Both directions share the device clock */
+	if (sinn7_pcm_other_substream(rt, sub)->instance && rt->stream_state != STREAM_DISABLED) {
+		ret = snd_pcm_hw_constraint_minmax(alsa_rt, SNDRV_PCM_HW_PARAM_RATE, rt->rate, rt->rate);
+		if (ret < 0) {
+			mutex_unlock(&rt->stream_mutex);
+			return ret;
+		}
+	}
+
 	sub->instance = alsa_sub;
 	sub->active = false;
+	sub->paused = false;
 	mutex_unlock(&rt->stream_mutex);
 	return 0;
 }
@@ -456,20 +981,24 @@ static int sinn7_pcm_close(struct snd_pcm_substream *alsa_sub)
 {
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
 	struct pcm_substream *sub = sinn7_pcm_get_substream(alsa_sub);
-	unsigned long flags;
 
 	if (rt->panic)
 		return 0;
 
 	mutex_lock(&rt->stream_mutex);
 	if (sub) {
-		sinn7_pcm_stream_stop(rt);
+		/* The other direction might still use the stream */
+		if (!sinn7_pcm_other_substream(rt, sub)->instance)
+			sinn7_pcm_stream_stop(rt);
 
 		/* deactivate substream */
-		spin_lock_irqsave(&sub->lock, flags);
+		WRITE_ONCE(sub->active, false);
+		WRITE_ONCE(sub->paused, false);
+		if (sub == &rt->capture) {
+			sinn7_pcm_sync_capture(rt);
+			WRITE_ONCE(rt->in_urb_frames, 0);
+		}
 		sub->instance = NULL;
-		sub->active = false;
-		spin_unlock_irqrestore(&sub->lock, flags);
 
 	}
 	mutex_unlock(&rt->stream_mutex);
@@ -479,12 +1008,43 @@ static int sinn7_pcm_close(struct snd_pcm_substream *alsa_sub)
 static int sinn7_pcm_hw_params(struct snd_pcm_substream *alsa_sub,
 				struct snd_pcm_hw_params *hw_params)
 {
+	struct pcm_substream *sub = sinn7_pcm_get_substream(alsa_sub);
+	
+	if (!sub)
+		return -ENODEV;
+	
+	switch (params_format(hw_params)) {
+	case SNDRV_PCM_FORMAT_S16_LE:
+		sub->format = &sinn7_format_s16_le;
+		break;
+	case SNDRV_PCM_FORMAT_S24_3LE:
+		sub->format = &sinn7_format_s24_3le;
+		break;
+	case SNDRV_PCM_FORMAT_S24_LE:
+		sub->format = &sinn7_format_s24_le;
+		break;
+	case SNDRV_PCM_FORMAT_S32_LE:
+		sub->format = &sinn7_format_s32_le;
+		break;
+	default:
+		return -EINVAL;
+	}
+	
 	return snd_pcm_lib_alloc_vmalloc_buffer(alsa_sub,
 						params_buffer_bytes(hw_params));
 }
 
 static int sinn7_pcm_hw_free(struct snd_pcm_substream *alsa_sub)
 {
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+
+	/* The fill worker might still encode from the buffer, an in urb
+	 * completion decode into it
+	 */
+	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		flush_work(&rt->fill_work);
+	else
+		sinn7_pcm_sync_capture(rt);
 	return snd_pcm_lib_free_vmalloc_buffer(alsa_sub);
 }
 
@@ -506,8 +1066,53 @@ static int sinn7_pcm_prepare(struct snd_pcm_substream *alsa_sub)
 
 	mutex_lock(&rt->stream_mutex);
 
+	/* A failed stream starts over, sinn7_pcm_error_work might not have run yet */
+	if (rt->failed && rt->stream_state != STREAM_DISABLED)
+		sinn7_pcm_stop_failed(rt);
+
+	/* The substream is stopped, but the fill worker might still be at its position */
+	flush_work(&rt->fill_work);
+	local_irq_disable();
+	write_seqcount_begin(&sub->pos_seq);
 	sub->dma_off = 0;
 	sub->period_off = 0;
+	write_seqcount_end(&sub->pos_seq);
+	local_irq_enable();
+
+	/* The device only changes its rate while it doesn't stream */
+	if (rt->stream_state != STREAM_DISABLED && rt->rate != alsa_rt->rate) {
+		if (sinn7_pcm_other_substream(rt, sub)->instance) {
+			mutex_unlock(&rt->stream_mutex);
+			return -EBUSY; /* the other direction runs at another rate */
+		}
+		sinn7_pcm_stream_stop(rt);
+	}
+
+	/* A changed urb configuration can only be applied while the urbs are idle */
+	if (rt->stream_state == STREAM_DISABLED) {
+		ret = sinn7_pcm_setup_urbs(rt);
+		if (ret) {
+			mutex_unlock(&rt->stream_mutex);
+			return ret;
+		}
+	}
+
+	/* The urbs were set up after the open, e.g. with more urbs from sysfs */
+	if (alsa_rt->buffer_size < (rt->n_urbs + 1) * PCM_BLOCK_FRAMES) {
+		mutex_unlock(&rt->stream_mutex);
+		dev_err(&rt->chip->dev->dev, "a buffer of %lu frames is too small for %u urbs\n",
+			alsa_rt->buffer_size, rt->n_urbs);
+		return -EINVAL;
+	}
+
+	/* The playback decides on the urb size, unless the stream is capture-only.
+	 * A stream which starts over always needs the size for the current urbs.
+	 * The in urbs follow the capture buffer.
+	 */
+	if (sub == &rt->playback || !rt->playback.instance || rt->stream_state == STREAM_DISABLED)
+		rt->urb_frames = sinn7_pcm_urb_frames(rt, alsa_rt);
+	if (sub == &rt->capture)
+		WRITE_ONCE(rt->in_urb_frames, sinn7_pcm_urb_frames(rt, alsa_rt));
 
 	if (rt->stream_state == STREAM_DISABLED) {
 		wasDisabled = true; // preserve, since the state might change
@@ -526,16 +1131,17 @@ static int sinn7_pcm_prepare(struct snd_pcm_substream *alsa_sub)
 		wasDisabled = false;
 	}
 	
-	mutex_unlock(&rt->stream_mutex);
+	/* The urb size might have changed since the timer was started */
+	sinn7_pcm_update_pacing(rt);
 	
-	if (wasDisabled && rt->timer == 0x0) {
-		rt->timer = (struct timer_list *)kzalloc(sizeof(struct timer_list), GFP_ATOMIC);
-        
-		setup_timer(rt->timer, sinn7_timer_interrupt, (unsigned long)rt);
-		rt->timer->expires = jiffies + msecs_to_jiffies(7);
-		add_timer(rt->timer);
+	if (wasDisabled && !rt->streaming) {
+		rt->lead = PCM_LEAD_MIN;
+		rt->on_time = 0;
+		hrtimer_start(&rt->timer, sinn7_pcm_timer_interval(rt), HRTIMER_MODE_REL);
 	}
 	
+	mutex_unlock(&rt->stream_mutex);
+	
 	return 0;
 }
 
@@ -543,26 +1149,45 @@ static int sinn7_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
 {
 	struct pcm_substream *sub = sinn7_pcm_get_substream(alsa_sub);
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	unsigned long flags;
 
 	if (rt->panic)
 		return -EPIPE;
 	if (!sub)
 		return -ENODEV;
 
+	/* A pause keeps the position and the urbs running with silence, so the
+	 * release continues right at the next urb. A stop lets the engine park.
+	 */
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
+		/* Pre-roll: the parked urbs are all idle, so the fill worker
+		 * encodes the application's first frames into them and submits
+		 * them right away. The time until the device took the first
+		 * frames is measured at the completion of their urb.
+		 */
+		if (sub == &rt->playback) {
+			atomic64_set(&rt->start_ns, ktime_get_ns());
+			trace_sinn7_start(rt->chip->card->number);
+		}
+		/* fall through */
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
-		spin_lock_irqsave(&sub->lock, flags);
-		sub->active = true;
-		spin_unlock_irqrestore(&sub->lock, flags);
+		if (rt->failed || rt->stream_state == STREAM_DISABLED)
+			return -EPIPE; /* the urbs failed, the stream needs a prepare */
+		WRITE_ONCE(sub->active, true);
+		WRITE_ONCE(sub->paused, false);
+		sinn7_pcm_wake(rt);
 		return 0;
 
-	case SNDRV_PCM_TRIGGER_STOP:
 	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
-		spin_lock_irqsave(&sub->lock, flags);
-		sub->active = false;
-		spin_unlock_irqrestore(&sub->lock, flags);
+		WRITE_ONCE(sub->paused, true);
+		WRITE_ONCE(sub->active, false);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_STOP:
+		WRITE_ONCE(sub->active, false);
+		WRITE_ONCE(sub->paused, false);
+		if (sub == &rt->playback)
+			atomic64_set(&rt->start_ns, 0);
 		return 0;
 
 	default:
@@ -570,19 +1195,50 @@ static int sinn7_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
 	}
 }
 
+/* The frames between the pointer and the device. The pointer moves urb by
+ * urb, at the time the frames are copied, so the delay is interpolated with
+ * the time since the last completion: For playback it's the frames in the
+ * urbs in flight, less what the device played of the oldest one so far. For
+ * capture it's the frames the device recorded, but didn't send yet.
+ */
+static snd_pcm_sframes_t sinn7_pcm_delay(struct pcm_runtime *rt, struct pcm_substream *sub,
+					 struct snd_pcm_runtime *alsa_rt)
+{
+	const bool playback = sub == &rt->playback;
+	const s64 completed = atomic64_read(&sub->completed);
+	const snd_pcm_uframes_t queued = max(atomic_read(&sub->queued), 0);
+	s64 since;
+	snd_pcm_uframes_t played;
+
+	if (!completed)
+		return playback ? queued : 0; /* nothing went through the device yet */
+
+	since = ktime_get_ns() - completed;
+	played = since > 0 ? div_u64((u64)since * alsa_rt->rate, NSEC_PER_SEC) : 0;
+	played = min(played, playback ? rt->urb_frames : sinn7_pcm_in_urb_frames(rt));
+
+	if (!playback)
+		return played;
+	return queued > played ? queued - played : 0;
+}
+
 static snd_pcm_uframes_t sinn7_pcm_pointer(struct snd_pcm_substream *alsa_sub)
 {
 	struct pcm_substream *sub = sinn7_pcm_get_substream(alsa_sub);
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	unsigned long flags;
 	snd_pcm_uframes_t dma_offset;
+	unsigned int seq;
 
 	if (rt->panic || !sub)
 		return SNDRV_PCM_POS_XRUN;
 
-	spin_lock_irqsave(&sub->lock, flags);
-	dma_offset = sub->dma_off;
-	spin_unlock_irqrestore(&sub->lock, flags);
+	/* Only retries while the writer publishes, which is a few stores */
+	do {
+		seq = read_seqcount_begin(&sub->pos_seq);
+		dma_offset = sub->dma_off;
+	} while (read_seqcount_retry(&sub->pos_seq, seq));
+
+	alsa_sub->runtime->delay = sinn7_pcm_delay(rt, sub, alsa_sub->runtime);
 	return bytes_to_frames(alsa_sub->runtime, dma_offset);
 }
 
@@ -599,73 +1255,239 @@ static struct snd_pcm_ops pcm_ops = {
 	.mmap = snd_pcm_lib_mmap_vmalloc,
 };
 
-static void sinn7_flush_buffers(struct urb *usb_urb, struct pcm_urb *out_urb, struct pcm_runtime *rt, unsigned long lock_flags)
+/* Whether the out urbs may be filled: the stream is starting or running */
+static bool sinn7_pcm_fillable(struct pcm_runtime *rt)
+{
+	const int state = READ_ONCE(rt->stream_state);
+
+	return !rt->panic && !rt->failed && (state == STREAM_STARTING || state == STREAM_RUNNING);
+}
+
+/* Encodes the next urb worth of frames (or silence) into the out urb and submits it.
+ * Runs in the fill worker, only the usb_submit_urb needs to be atomic.
+ * due is when the urb became refillable (0 if unknown), for the submit latency */
+static void sinn7_flush_buffers(struct pcm_runtime *rt, struct pcm_urb *out_urb, ktime_t due)
 {
-	struct pcm_substream *sub;
+	struct pcm_substream *sub = &rt->playback;
 	bool do_period_elapsed = false;
+	const snd_pcm_uframes_t frames = rt->urb_frames;
+	const snd_pcm_uframes_t dma_off = sub->dma_off; /* the worker is its writer */
+	const bool active = READ_ONCE(sub->active);
 	int ret;
 	
-	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+	if (!sinn7_pcm_fillable(rt))
 		return;
 	
-	/* now send our playback data (if a free out urb was found) */
-	sub = &rt->playback;
+	out_urb->dma_off = dma_off;
 
-	if (sub->active) {
-		do_period_elapsed = sinn7_pcm_playback(sub, out_urb);
+	if (active) {
+		do_period_elapsed = sinn7_pcm_playback(sub, out_urb, dma_off, frames);
+		out_urb->silent = 0;
+		out_urb->start_ns = atomic64_read(&rt->start_ns) ? atomic64_xchg(&rt->start_ns, 0) : 0;
 	}
-	else {
-		memset(out_urb->buffer, 0, MAX_PACKET_SIZE);
+	else if (out_urb->silent < frames) {
+		/* The device clock keeps running, e.g. for a capture-only stream. An urb
+		 * which went out with silence before still holds it, so only the first
+		 * silent round costs a copy.
+		 */
+		memcpy(out_urb->buffer, rt->silence, sinn7_framecount_to_buffersize(frames));
+		out_urb->silent = frames;
 	}
 
 	if (do_period_elapsed) {
-		spin_unlock_irqrestore(&sub->lock, lock_flags); // unlock
+		trace_sinn7_period_elapsed(true, sub->dma_off);
 		snd_pcm_period_elapsed(sub->instance);
-		spin_lock_irqsave(&sub->lock, lock_flags);
 	}
 
-	if (sub->instance->runtime->period_size > 390) {
-		dev_warn(&rt->chip->dev->dev, "period_size = %lu, > 390\n", sub->instance->runtime->period_size);
-	}
+	out_urb->instance.transfer_buffer_length = sinn7_framecount_to_buffersize(frames);
 	
-	out_urb->instance.transfer_buffer_length = sinn7_framecount_to_buffersize(sub->instance->runtime->period_size);
-	sinn7_frames_to_buffer_ex(out_urb->buffer, sub->instance->runtime->period_size, 2, out_urb->buffer);
+	if (ktime_to_ns(due))
+		sinn7_stats_time(rt->stats.submit_latency, ktime_to_ns(ktime_sub(ktime_get(), due)));
 	
-	ret = usb_submit_urb(&out_urb->instance, GFP_ATOMIC);
+	out_urb->frames = frames;
+	atomic_add(frames, &sub->queued);
+	ret = atomic_inc_return(&rt->in_flight);
+	if (ret == 1)
+		atomic64_set(&sub->completed, ktime_get_ns()); /* the device starts over with this urb */
+	sinn7_stats_in_flight(&rt->stats, ret);
+	trace_sinn7_urb_submit(true, out_urb->index, out_urb->instance.transfer_buffer_length, out_urb->dma_off);
+	usb_anchor_urb(&out_urb->instance, &rt->out_anchor);
+	ret = usb_submit_urb(&out_urb->instance, GFP_KERNEL);
 	if (ret < 0) {
+		usb_unanchor_urb(&out_urb->instance);
+		atomic_dec(&rt->in_flight);
+		atomic_sub(frames, &sub->queued);
+		if (rt->stream_state == STREAM_STOPPING)
+			return; /* the urb is being killed, it refuses resubmission */
+		
+		atomic_long_inc(&rt->stats.submit_errors);
 		dev_warn(&rt->chip->dev->dev, "usb_submit_urb returned %d\n", ret);
-		goto out_fail;
+		sinn7_pcm_urb_failed(rt, true, ret);
+		return;
 	}
+	atomic_long_inc(&rt->stats.out_submitted);
+}
 
-	return;
+/* The fill worker: Encodes and submits the idle out urbs in process context,
+ * so the conversion doesn't run with interrupts off. The streaming engine
+ * refills every urb the device consumed, the timer pacing tops the queue up
+ * to the lead.
+ */
+static void sinn7_pcm_fill_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(work, struct pcm_runtime, fill_work);
+	const ktime_t timer_due = rt->timer_due;
+	unsigned int i;
 
-out_fail:
-	rt->panic = true;
-	dev_err(&rt->chip->dev->dev, "PANIC!\n");
-	
+	while (sinn7_pcm_fillable(rt)) {
+		if (!rt->streaming && atomic_read(&rt->in_flight) >= rt->lead)
+			return;
+
+		i = find_first_bit(rt->idle_urbs, rt->n_urbs);
+		if (i >= rt->n_urbs) {
+			/* All urbs are busy, but the lead isn't reached */
+			if (!rt->streaming)
+				atomic_long_inc(&rt->stats.underruns);
+			return;
+		}
+		clear_bit(i, rt->idle_urbs);
+		smp_mb__after_atomic();
+
+		sinn7_flush_buffers(rt, &rt->out_urbs[i], rt->streaming ? rt->out_urbs[i].due : timer_due);
+	}
+}
+
+/* Queues the fill worker on the cpu of the card, if that is online */
+static void sinn7_pcm_queue_fill(struct pcm_runtime *rt)
+{
+	const int cpu = READ_ONCE(rt->cpu);
+
+	if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+		queue_work_on(cpu, rt->fill_wq, &rt->fill_work);
+	else
+		queue_work(rt->fill_wq, &rt->fill_work);
 }
 
 static int sinn7_pcm_init_urb(struct pcm_urb *urb,
 			       struct sinn7_chip *chip,
-			       unsigned int ep,
+			       unsigned int pipe,
+			       unsigned int size,
 			       void (*handler)(struct urb *))
 {
 	urb->chip = chip;
 	usb_init_urb(&urb->instance);
 
-	urb->buffer = kzalloc(MAX_PACKET_SIZE, GFP_KERNEL);
+	urb->buffer = usb_alloc_coherent(chip->dev, size, GFP_KERNEL, &urb->dma);
 	if (!urb->buffer)
 		return -ENOMEM;
+	urb->size = size;
+	urb->silent = 0;
+	memset(urb->buffer, 0, size);
 	
 	usb_fill_bulk_urb(&urb->instance, chip->dev,
-			  usb_sndbulkpipe(chip->dev, ep), (void *)urb->buffer,
-			  MAX_PACKET_SIZE, handler, urb);
-	init_usb_anchor(&urb->submitted);
+			  pipe, (void *)urb->buffer,
+			  size, handler, urb);
+	urb->instance.transfer_dma = urb->dma;
+	urb->instance.transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
 	urb->instance.context = (void*)urb;
 	return 0;
 }
 
+static void sinn7_pcm_free_urb(struct pcm_urb *urb)
+{
+	if (urb->buffer)
+		usb_free_coherent(urb->chip->dev, urb->size, urb->buffer, urb->dma);
+	urb->buffer = NULL;
+}
+
+static void sinn7_pcm_free_urbs(struct pcm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < PCM_N_URBS_MAX; i++) {
+		sinn7_pcm_free_urb(&rt->out_urbs[i]);
+		sinn7_pcm_free_urb(&rt->in_urbs[i]);
+	}
+	kfree(rt->silence);
+	rt->silence = NULL;
+	rt->n_urbs = 0;
+}
+
+static unsigned int sinn7_pcm_cfg_urbs(struct pcm_runtime *rt)
+{
+	const unsigned int n = READ_ONCE(rt->cfg_urbs) ?: READ_ONCE(urbs);
+
+	return clamp_t(unsigned int, n, PCM_N_URBS_MIN, PCM_N_URBS_MAX);
+}
+
+static unsigned int sinn7_pcm_cfg_urb_size(struct pcm_runtime *rt)
+{
+	const unsigned int size = READ_ONCE(rt->cfg_urb_size) ?: READ_ONCE(urb_size);
+
+	return rounddown(clamp_t(unsigned int, size, PCM_BLOCK_SIZE, PCM_URB_SIZE_MAX), PCM_BLOCK_SIZE);
+}
+
+static unsigned int sinn7_pcm_cfg_batch(struct pcm_runtime *rt)
+{
+	const unsigned int n = READ_ONCE(rt->cfg_batch) ?: READ_ONCE(batch);
+
+	return clamp_t(unsigned int, n, 1, PCM_BATCH_MAX);
+}
+
+/* (Re)allocates the urbs if their number or size was changed.
+ * call with stream_mutex locked and the stream stopped */
+static int sinn7_pcm_setup_urbs(struct pcm_runtime *rt)
+{
+	struct sinn7_chip *chip = rt->chip;
+	const unsigned int n_urbs = sinn7_pcm_cfg_urbs(rt);
+	const unsigned int size = sinn7_pcm_cfg_urb_size(rt);
+	const unsigned int n_batch = sinn7_pcm_cfg_batch(rt);
+	const unsigned int max_packet_size = size * n_batch * (rt->extra_freq ? PCM_RATE_FACTOR_MAX : PCM_RATE_FACTOR(96000));
+	const snd_pcm_uframes_t urb_frames_max = (size / PCM_BLOCK_SIZE) * PCM_BLOCK_FRAMES;
+	int ret;
+	int i;
+
+	/* The buffers only need to be reallocated if their size changes */
+	if (n_urbs == rt->n_urbs && max_packet_size == rt->max_packet_size)
+		goto out_commit;
+
+	sinn7_pcm_free_urbs(rt);
+
+	for (i = 0; i < n_urbs; i++) {
+		ret = sinn7_pcm_init_urb(&rt->out_urbs[i], chip, usb_sndbulkpipe(chip->dev, OUT_EP),
+					 max_packet_size, sinn7_pcm_out_urb_handler);
+		if (ret)
+			goto out_fail;
+		rt->out_urbs[i].index = i;
+		ret = sinn7_pcm_init_urb(&rt->in_urbs[i], chip, usb_rcvbulkpipe(chip->dev, IN_EP),
+					 max_packet_size, sinn7_pcm_in_urb_handler);
+		if (ret)
+			goto out_fail;
+		rt->in_urbs[i].index = i;
+	}
+
+	rt->silence = kmalloc(max_packet_size, GFP_KERNEL);
+	if (!rt->silence) {
+		ret = -ENOMEM;
+		goto out_fail;
+	}
+	sinn7_silence_to_buffer(rt->silence, (max_packet_size / PCM_BLOCK_SIZE) * PCM_BLOCK_FRAMES);
+
+	dev_dbg(&chip->dev->dev, "using %u urbs of %u bytes\n", n_urbs, max_packet_size);
+	rt->n_urbs = n_urbs;
+	rt->max_packet_size = max_packet_size;
+
+out_commit:
+	rt->batch = n_batch;
+	rt->urb_frames_max = urb_frames_max;
+	return 0;
+
+out_fail:
+	sinn7_pcm_free_urbs(rt);
+	return ret;
+}
+
 void sinn7_pcm_abort(struct sinn7_chip *chip)
 {
 	struct pcm_runtime *rt = chip->pcm;
@@ -677,16 +1499,22 @@ void sinn7_pcm_abort(struct sinn7_chip *chip)
 		mutex_lock(&rt->stream_mutex);
 		sinn7_pcm_stream_stop(rt);
 		mutex_unlock(&rt->stream_mutex);
+		cancel_work_sync(&rt->error_work);
 	}
 }
 
 static void sinn7_pcm_destroy(struct sinn7_chip *chip)
 {
 	struct pcm_runtime *rt = chip->pcm;
-	int i;
 
-	for (i = 0; i < PCM_N_URBS; i++)
-		kfree(rt->out_urbs[i].buffer);
+	/* The buffers belong to the host controller, which is still around
+	 * thanks to the reference taken in sinn7_pcm_init.
+	 */
+	sinn7_stats_free(&rt->stats);
+	cancel_work_sync(&rt->error_work);
+	destroy_workqueue(rt->fill_wq);
+	sinn7_pcm_free_urbs(rt);
+	usb_put_dev(chip->dev);
 
 	kfree(chip->pcm);
 	chip->pcm = NULL;
@@ -702,7 +1530,6 @@ static void sinn7_pcm_free(struct snd_pcm *pcm)
 
 int sinn7_pcm_init(struct sinn7_chip *chip, u8 extra_freq)
 {
-	int i;
 	int ret;
 	struct snd_pcm *pcm;
 	struct pcm_runtime *rt;
@@ -713,19 +1540,43 @@ int sinn7_pcm_init(struct sinn7_chip *chip, u8 extra_freq)
 
 	rt->chip = chip;
 	rt->stream_state = STREAM_DISABLED;
+	rt->encoder = sinn7_encoder_select();
+	dev_dbg(&chip->dev->dev, "using the %s encoder\n", rt->encoder->name);
 	if (extra_freq)
 		rt->extra_freq = 1;
 
 	init_waitqueue_head(&rt->stream_wait_queue);
+	init_usb_anchor(&rt->out_anchor);
 	mutex_init(&rt->stream_mutex);
-	spin_lock_init(&rt->playback.lock);
+	seqcount_init(&rt->playback.pos_seq);
+	seqcount_init(&rt->capture.pos_seq);
+	hrtimer_init(&rt->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	rt->timer.function = sinn7_timer_interrupt;
+	INIT_WORK(&rt->fill_work, sinn7_pcm_fill_work);
+	INIT_WORK(&rt->error_work, sinn7_pcm_error_work);
+	rt->cpu = chip->cpu;
+
+	/* A queue per card, so the cards don't wait for each other */
+	rt->fill_wq = alloc_workqueue("snd-usb-sinn7-%d", WQ_HIGHPRI, 0, chip->card->number);
+	if (!rt->fill_wq) {
+		kfree(rt);
+		return -ENOMEM;
+	}
 
-	for (i = 0; i < PCM_N_URBS; i++)
-		sinn7_pcm_init_urb(&rt->out_urbs[i], chip, OUT_EP,
-				    sinn7_pcm_out_urb_handler);
+	usb_get_dev(chip->dev);
+	ret = sinn7_pcm_setup_urbs(rt);
+	if (ret < 0) {
+		destroy_workqueue(rt->fill_wq);
+		usb_put_dev(chip->dev);
+		kfree(rt);
+		return ret;
+	}
 
-	ret = snd_pcm_new(chip->card, "Stereo USB Audio", 0, 1, 0, &pcm);
+	ret = snd_pcm_new(chip->card, "Stereo USB Audio", 0, 1, 1, &pcm);
 	if (ret < 0) {
+		destroy_workqueue(rt->fill_wq);
+		sinn7_pcm_free_urbs(rt);
+		usb_put_dev(chip->dev);
 		kfree(rt);
 		dev_err(&chip->dev->dev, "Cannot create pcm instance\n");
 		return ret;
@@ -736,39 +1587,160 @@ int sinn7_pcm_init(struct sinn7_chip *chip, u8 extra_freq)
 
 	strlcpy(pcm->name, "Stereo USB Audio", sizeof(pcm->name));
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_ops);
 
 	rt->instance = pcm;
+	sinn7_stats_init(&rt->stats, chip->card, &rt->in_flight);
 
 	chip->pcm = rt;
 	return 0;
 }
 
-void sinn7_timer_interrupt(unsigned long data) {
-	uint8_t i;
+/* Timer pacing: Has the fill worker top the queue up to rt->lead urbs twice per urb,
+ * while any direction is active */
+enum hrtimer_restart sinn7_timer_interrupt(struct hrtimer *timer) {
 	struct pcm_runtime *rt;
-	struct pcm_substream *sub;
-	unsigned long flags;
 	
-	rt = (struct pcm_runtime *)data;
-	sub = &rt->playback;
-
-	spin_lock_irqsave(&sub->lock, flags);
+	rt = container_of(timer, struct pcm_runtime, timer);
 	
-	if (sub->active)
-	{
-		for (i = 0; i < PCM_N_URBS; i++) {
-			if (rt->out_urbs[i].instance.complete && !rt->out_urbs[i].instance.hcpriv) {
-				rt->out_urbs[i].instance.context = (void*)(&rt->out_urbs[i]);
-				sinn7_flush_buffers(&rt->out_urbs[i].instance, &rt->out_urbs[i], rt, flags);
-				break;
-			}
-		}
-		
+	if (rt->panic || rt->failed) {
+		return HRTIMER_NORESTART;
 	}
 	
-	if (!rt->panic) {
-		mod_timer(rt->timer, jiffies + msecs_to_jiffies(2));
+	if (sinn7_pcm_idle(rt)) {
+		/* Nothing to pace, sleep until sinn7_pcm_wake */
+		atomic_set(&rt->timer_parked, 1);
+		smp_mb__after_atomic();
+		if (sinn7_pcm_idle(rt) || !atomic_xchg(&rt->timer_parked, 0))
+			return HRTIMER_NORESTART;
 	}
-		
-	spin_unlock_irqrestore(&sub->lock, flags);
+	
+	rt->timer_due = hrtimer_get_expires(timer);
+	sinn7_pcm_queue_fill(rt);
+	
+	hrtimer_forward_now(timer, sinn7_pcm_timer_interval(rt));
+	return HRTIMER_RESTART;
+}
+
+static ssize_t urbs_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", sinn7_pcm_cfg_urbs(chip->pcm));
 }
+
+static ssize_t urbs_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+	unsigned int value;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &value);
+	if (ret)
+		return ret;
+	if (value && (value < PCM_N_URBS_MIN || value > PCM_N_URBS_MAX))
+		return -EINVAL;
+
+	WRITE_ONCE(chip->pcm->cfg_urbs, value);
+	return count;
+}
+static DEVICE_ATTR_RW(urbs);
+
+static ssize_t urb_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", sinn7_pcm_cfg_urb_size(chip->pcm));
+}
+
+static ssize_t urb_size_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+	unsigned int value;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &value);
+	if (ret)
+		return ret;
+	if (value && (value < PCM_BLOCK_SIZE || value > PCM_URB_SIZE_MAX))
+		return -EINVAL;
+
+	WRITE_ONCE(chip->pcm->cfg_urb_size, value);
+	return count;
+}
+static DEVICE_ATTR_RW(urb_size);
+
+static ssize_t batch_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", sinn7_pcm_cfg_batch(chip->pcm));
+}
+
+static ssize_t batch_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+	unsigned int value;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &value);
+	if (ret)
+		return ret;
+	if (value > PCM_BATCH_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(chip->pcm->cfg_batch, value);
+	return count;
+}
+static DEVICE_ATTR_RW(batch);
+
+static ssize_t cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(chip->pcm->cpu));
+}
+
+/* -1 lets the fill worker run anywhere, the default cpu of the card is picked in the probe */
+static ssize_t cpu_store(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct sinn7_chip *chip = dev_get_drvdata(dev);
+	int value;
+	int ret;
+
+	ret = kstrtoint(buf, 0, &value);
+	if (ret)
+		return ret;
+	if (value < -1 || value >= nr_cpu_ids || (value >= 0 && !cpu_possible(value)))
+		return -EINVAL;
+
+	WRITE_ONCE(chip->pcm->cpu, value);
+	return count;
+}
+static DEVICE_ATTR_RW(cpu);
+
+/* Per card overrides of the urbs, urb_size and batch parameters, on the usb interface.
+ * Writing 0 follows the module parameter again. Like those, a new value is
+ * applied by the next prepare which finds the stream stopped.
+ * The cpu of the fill worker applies right away.
+ */
+static struct attribute *sinn7_pcm_attrs[] = {
+	&dev_attr_urbs.attr,
+	&dev_attr_urb_size.attr,
+	&dev_attr_batch.attr,
+	&dev_attr_cpu.attr,
+	NULL
+};
+
+const struct attribute_group sinn7_pcm_attr_group = {
+	.attrs = sinn7_pcm_attrs,
+};
+
+const struct attribute_group *sinn7_pcm_attr_groups[] = {
+	&sinn7_pcm_attr_group,
+	NULL
+};
@@ -19,6 +19,10 @@
 #define SINN7_PCM_H
 
 struct sinn7_chip;
+struct attribute_group;
+
+extern const struct attribute_group sinn7_pcm_attr_group;
+extern const struct attribute_group *sinn7_pcm_attr_groups[];
 
 int sinn7_pcm_init(struct sinn7_chip *chip, u8 extra_freq);
 void sinn7_pcm_abort(struct sinn7_chip *chip);
@@ -0,0 +1,799 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/* A stand-in for the device (make gadget), so the driver can be tested without
+ * the hardware: It registers as a Status 24|96 with the raw_gadget interface of
+ * a usb device controller, normally dummy_hcd, which connects it to the usb
+ * host of the same machine:
+ *
+ *	modprobe dummy_hcd
+ *	modprobe raw_gadget
+ *	userspace/sinn7_gadget
+ *
+ * The driver then binds to it like to the real device. The gadget answers the
+ * vendor handshake of sinn7_chip_probe and the rate requests, takes the
+ * playback from endpoint 0x05 at the real device rate and sends captured data
+ * on endpoint 0x86 at the same rate.
+ *
+ * The playback is decoded and checked: Each block must hold device bytes of 0
+ * or 1 and end with the padding frame, a late block is an underrun of the
+ * device (it would have played silence). With -p it also has to be the test
+ * pattern of -g, bit-exactly and without discontinuities. Every second one
+ * JSON object per line is printed to stdout, a summary on SIGINT. The exit
+ * code is non-zero if the playback had format or pattern errors.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "encode.h"
+
+#define GADGET_VENDOR    0x200c
+#define GADGET_PRODUCT   0x1006
+#define GADGET_OUT_EP    0x05
+#define GADGET_IN_EP     0x86
+#define GADGET_MAX_PACKET 512
+#define GADGET_EP0_MAX   64
+#define GADGET_CTRL_MAX  4096 /* The data stage of a control request */
+
+#define UAC_SET_CUR 0x01
+#define UAC_GET_CUR 0x81
+
+/* The s24_3le test pattern: the left sample counts the frames (the top bit is
+ * always set, so the pattern never looks like silence), the right sample is
+ * its complement.
+ */
+#define PATTERN_LEFT(n)  (0x800000 | ((n) & 0x7fffff))
+#define PATTERN_RIGHT(n) (PATTERN_LEFT(n) ^ 0xffffff)
+
+static const struct sinn7_format *const gadget_format = &sinn7_format_s24_3le;
+
+/* Both run from the main thread and the endpoint threads */
+static volatile sig_atomic_t gadget_stop;
+static pthread_mutex_t gadget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct gadget_stats {
+	uint64_t out_bytes;
+	uint64_t out_blocks;
+	uint64_t underruns; /* a block arrived after the device needed it */
+	uint64_t restarts; /* the same after silence, the driver parked its urbs */
+	uint64_t late_max_ns; /* the worst of them */
+	uint64_t format_errors; /* blocks with a device byte > 1 or a wrong padding frame */
+	uint64_t silent_frames;
+	uint64_t pattern_frames;
+	uint64_t pattern_errors; /* frames with a sample that isn't the pattern */
+	uint64_t discontinuities; /* the pattern didn't go on where it stopped */
+	uint64_t in_bytes;
+	uint64_t overruns; /* the host didn't fetch a captured block in time */
+};
+
+static struct {
+	int fd;
+	unsigned int rate;
+	unsigned int rate_gen; /* counts the rate changes, the streams re-anchor then */
+	unsigned int fifo_blocks;
+	bool check_pattern;
+	FILE *dump;
+	int out_ep;
+	int in_ep;
+	pthread_t out_thread;
+	pthread_t in_thread;
+	struct gadget_stats stats; /* under gadget_lock */
+} gadget = {
+	.fd = -1,
+	.rate = 44100,
+	.fifo_blocks = 8,
+	.out_ep = -1,
+	.in_ep = -1,
+};
+
+static const struct usb_device_descriptor gadget_device_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = USB_CLASS_PER_INTERFACE,
+	.bMaxPacketSize0 = GADGET_EP0_MAX,
+	.idVendor = GADGET_VENDOR,
+	.idProduct = GADGET_PRODUCT,
+	.bcdDevice = 0x0100,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_qualifier_descriptor gadget_qualifier_desc = {
+	.bLength = sizeof(struct usb_qualifier_descriptor),
+	.bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = USB_CLASS_PER_INTERFACE,
+	.bMaxPacketSize0 = GADGET_EP0_MAX,
+	.bNumConfigurations = 1,
+};
+
+/* Both interfaces have an empty alternate setting 0 and the bulk endpoint in
+ * 1, which sinn7_chip_probe selects. They are vendor specific, so
+ * snd-usb-audio leaves the gadget alone.
+ */
+static const struct usb_endpoint_descriptor gadget_out_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = GADGET_OUT_EP,
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize = GADGET_MAX_PACKET,
+};
+
+static const struct usb_endpoint_descriptor gadget_in_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = GADGET_IN_EP,
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize = GADGET_MAX_PACKET,
+};
+
+static const char *const gadget_strings[] = { NULL, "Sinn7 (gadget)", "Status 24|96" };
+
+static uint64_t gadget_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void gadget_sleep_until(uint64_t ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !gadget_stop)
+		;
+}
+
+/* The current rate and its generation */
+static unsigned int gadget_rate(unsigned int *gen)
+{
+	unsigned int rate;
+
+	pthread_mutex_lock(&gadget_lock);
+	rate = gadget.rate;
+	*gen = gadget.rate_gen;
+	pthread_mutex_unlock(&gadget_lock);
+	return rate;
+}
+
+/* When the device needs (or has) the frame after the first frames of a stream */
+static uint64_t gadget_frame_time(uint64_t start, uint64_t frames, unsigned int rate)
+{
+	return start + frames * 1000000000ULL / rate;
+}
+
+/* Builds the configuration descriptor, returns its length */
+static size_t gadget_config_desc(u8 *buffer)
+{
+	struct usb_config_descriptor *config = (struct usb_config_descriptor *)buffer;
+	size_t length = USB_DT_CONFIG_SIZE;
+	int ifnum, alt;
+
+	for (ifnum = 0; ifnum < 2; ifnum++) {
+		for (alt = 0; alt < 2; alt++) {
+			struct usb_interface_descriptor *intf =
+				(struct usb_interface_descriptor *)(buffer + length);
+
+			memset(intf, 0, USB_DT_INTERFACE_SIZE);
+			intf->bLength = USB_DT_INTERFACE_SIZE;
+			intf->bDescriptorType = USB_DT_INTERFACE;
+			intf->bInterfaceNumber = ifnum;
+			intf->bAlternateSetting = alt;
+			intf->bNumEndpoints = alt;
+			intf->bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+			length += USB_DT_INTERFACE_SIZE;
+
+			if (alt) {
+				memcpy(buffer + length, ifnum ? &gadget_in_desc : &gadget_out_desc,
+				       USB_DT_ENDPOINT_SIZE);
+				length += USB_DT_ENDPOINT_SIZE;
+			}
+		}
+	}
+
+	memset(config, 0, USB_DT_CONFIG_SIZE);
+	config->bLength = USB_DT_CONFIG_SIZE;
+	config->bDescriptorType = USB_DT_CONFIG;
+	config->wTotalLength = length;
+	config->bNumInterfaces = 2;
+	config->bConfigurationValue = 1;
+	config->bmAttributes = USB_CONFIG_ATT_ONE;
+	config->bMaxPower = 250; /* 500 mA */
+	return length;
+}
+
+/* Builds a string descriptor (the language list for index 0), returns its length or -1 */
+static int gadget_string_desc(u8 *buffer, unsigned int index)
+{
+	const char *string;
+	int i;
+
+	buffer[1] = USB_DT_STRING;
+	if (index == 0) {
+		buffer[0] = 4;
+		buffer[2] = 0x09; /* en-US */
+		buffer[3] = 0x04;
+		return 4;
+	}
+	if (index >= sizeof(gadget_strings) / sizeof(gadget_strings[0]))
+		return -1;
+
+	string = gadget_strings[index];
+	for (i = 0; string[i]; i++) {
+		buffer[2 + 2 * i] = string[i];
+		buffer[3 + 2 * i] = 0;
+	}
+	buffer[0] = 2 + 2 * i;
+	return buffer[0];
+}
+
+/* Checks a playback block and hands its frames to the pattern check and the
+ * dump. Returns whether the block holds anything but silence.
+ */
+static bool gadget_check_block(const u8 *block, struct gadget_stats *stats, uint64_t *expected)
+{
+	u8 frames[PCM_BLOCK_FRAMES * 6];
+	bool bad = false;
+	bool audio = false;
+	int i;
+
+	for (i = 0; i < PCM_BLOCK_FRAMES * PCM_FRAME_SIZE; i++)
+		bad |= block[i] > 1;
+	bad |= block[PCM_BLOCK_FRAMES * PCM_FRAME_SIZE] != 0xFD ||
+	       block[PCM_BLOCK_FRAMES * PCM_FRAME_SIZE + 1] != 0xFF;
+	for (i = PCM_BLOCK_FRAMES * PCM_FRAME_SIZE + 2; i < PCM_BLOCK_SIZE; i++)
+		bad |= block[i] != 0;
+	if (bad)
+		stats->format_errors++;
+
+	sinn7_buffer_to_frames(frames, block, 0, PCM_BLOCK_FRAMES, gadget_format, &sinn7_encoder_scalar);
+	if (gadget.dump)
+		fwrite(frames, sizeof(frames), 1, gadget.dump);
+
+	for (i = 0; i < PCM_BLOCK_FRAMES; i++) {
+		const u8 *frame = frames + i * 6;
+		const uint32_t left = frame[0] | (frame[1] << 8) | (frame[2] << 16);
+		const uint32_t right = frame[3] | (frame[4] << 8) | (frame[5] << 16);
+
+		if (!left && !right) {
+			stats->silent_frames++;
+			continue;
+		}
+		stats->pattern_frames++;
+		audio = true;
+		if (!gadget.check_pattern)
+			continue;
+
+		if (!(left & 0x800000) || right != (left ^ 0xffffff)) {
+			stats->pattern_errors++;
+			continue;
+		}
+		/* Silence in between (a pause or an underrun of the driver) is fine,
+		 * as long as the pattern goes on where it stopped or starts over.
+		 */
+		if (*expected != UINT64_MAX && left != PATTERN_LEFT(*expected) && left != PATTERN_LEFT(0))
+			stats->discontinuities++;
+		*expected = (left & 0x7fffff) + 1;
+	}
+	return audio;
+}
+
+/* Takes the playback like the device: A block per packet, not more than the
+ * fifo ahead of the time it's played. A block that arrives after its time
+ * is an underrun, the stream starts over from there. If the blocks before were
+ * silent, the driver just parked its urbs while idle.
+ */
+static void *gadget_out_thread(void *arg)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		u8 data[PCM_BLOCK_SIZE];
+	} block;
+	uint64_t expected = UINT64_MAX;
+	uint64_t start = 0, frames = 0;
+	unsigned int rate = 0, gen, oldGen = 0;
+	struct gadget_stats stats;
+	bool audio = false;
+	uint64_t now;
+	int ret;
+
+	while (!gadget_stop) {
+		block.io.ep = gadget.out_ep;
+		block.io.flags = 0;
+		block.io.length = PCM_BLOCK_SIZE;
+		ret = ioctl(gadget.fd, USB_RAW_IOCTL_EP_READ, &block);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("reading endpoint 0x05");
+			break;
+		}
+
+		now = gadget_now();
+		memset(&stats, 0, sizeof(stats));
+		stats.out_bytes = ret;
+		if (ret != PCM_BLOCK_SIZE)
+			stats.format_errors++;
+
+		rate = gadget_rate(&gen);
+		if (!frames || gen != oldGen) {
+			start = now;
+			frames = 0;
+			oldGen = gen;
+		} else if (now > gadget_frame_time(start, frames, rate)) {
+			if (audio) {
+				stats.underruns++;
+				stats.late_max_ns = now - gadget_frame_time(start, frames, rate);
+			} else {
+				stats.restarts++;
+			}
+			start = now;
+			frames = 0;
+		}
+		frames += PCM_BLOCK_FRAMES;
+
+		if (ret == PCM_BLOCK_SIZE) {
+			stats.out_blocks++;
+			audio = gadget_check_block(block.data, &stats, &expected);
+		}
+
+		pthread_mutex_lock(&gadget_lock);
+		gadget.stats.out_bytes += stats.out_bytes;
+		gadget.stats.out_blocks += stats.out_blocks;
+		gadget.stats.underruns += stats.underruns;
+		gadget.stats.restarts += stats.restarts;
+		if (stats.late_max_ns > gadget.stats.late_max_ns)
+			gadget.stats.late_max_ns = stats.late_max_ns;
+		gadget.stats.format_errors += stats.format_errors;
+		gadget.stats.silent_frames += stats.silent_frames;
+		gadget.stats.pattern_frames += stats.pattern_frames;
+		gadget.stats.pattern_errors += stats.pattern_errors;
+		gadget.stats.discontinuities += stats.discontinuities;
+		pthread_mutex_unlock(&gadget_lock);
+
+		/* The fifo is full, the device would NAK until it played a block */
+		if (frames > gadget.fifo_blocks * PCM_BLOCK_FRAMES)
+			gadget_sleep_until(gadget_frame_time(start, frames - gadget.fifo_blocks * PCM_BLOCK_FRAMES,
+							     rate));
+	}
+	return NULL;
+}
+
+/* Sends the test pattern as captured data, a block at the time it was
+ * recorded. A block the host takes too late is an overrun of the device, which
+ * includes the times the driver parks its urbs.
+ */
+static void *gadget_in_thread(void *arg)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		u8 data[PCM_BLOCK_SIZE];
+	} block;
+	u8 frames[PCM_BLOCK_FRAMES * 6];
+	uint64_t pattern = 0;
+	uint64_t start = 0, sent = 0;
+	unsigned int rate, gen, oldGen = 0;
+	uint64_t now;
+	int i, ret;
+
+	while (!gadget_stop) {
+		for (i = 0; i < PCM_BLOCK_FRAMES; i++, pattern++) {
+			const uint32_t left = PATTERN_LEFT(pattern);
+			const uint32_t right = PATTERN_RIGHT(pattern);
+
+			frames[i * 6 + 0] = left;
+			frames[i * 6 + 1] = left >> 8;
+			frames[i * 6 + 2] = left >> 16;
+			frames[i * 6 + 3] = right;
+			frames[i * 6 + 4] = right >> 8;
+			frames[i * 6 + 5] = right >> 16;
+		}
+		sinn7_frames_to_buffer(block.data, 0, frames, PCM_BLOCK_FRAMES, gadget_format,
+				       &sinn7_encoder_scalar);
+		sinn7_finish_buffer(block.data, PCM_BLOCK_FRAMES);
+
+		rate = gadget_rate(&gen);
+		if (!sent || gen != oldGen) {
+			start = gadget_now();
+			sent = 0;
+			oldGen = gen;
+		}
+		sent += PCM_BLOCK_FRAMES;
+		gadget_sleep_until(gadget_frame_time(start, sent, rate));
+
+		block.io.ep = gadget.in_ep;
+		block.io.flags = 0;
+		block.io.length = PCM_BLOCK_SIZE;
+		ret = ioctl(gadget.fd, USB_RAW_IOCTL_EP_WRITE, &block);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("writing endpoint 0x86");
+			break;
+		}
+
+		now = gadget_now();
+		pthread_mutex_lock(&gadget_lock);
+		gadget.stats.in_bytes += ret;
+		/* The next block is recorded by now, the fifo holds the rest */
+		if (now > gadget_frame_time(start, sent + gadget.fifo_blocks * PCM_BLOCK_FRAMES, rate)) {
+			gadget.stats.overruns++;
+			sent = 0;
+		}
+		pthread_mutex_unlock(&gadget_lock);
+	}
+	return NULL;
+}
+
+/* Enables the endpoint of an interface for its alternate setting 1, once */
+static int gadget_enable(int ifnum)
+{
+	int *ep = ifnum ? &gadget.in_ep : &gadget.out_ep;
+	int ret;
+
+	if (*ep >= 0)
+		return 0;
+
+	ret = ioctl(gadget.fd, USB_RAW_IOCTL_EP_ENABLE, ifnum ? &gadget_in_desc : &gadget_out_desc);
+	if (ret < 0) {
+		perror("enabling the endpoint");
+		return -1;
+	}
+	*ep = ret;
+
+	ret = pthread_create(ifnum ? &gadget.in_thread : &gadget.out_thread, NULL,
+			     ifnum ? gadget_in_thread : gadget_out_thread, NULL);
+	if (ret) {
+		fprintf(stderr, "can't start the endpoint thread: %s\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+static bool gadget_rate_valid(unsigned int rate)
+{
+	static const unsigned int rates[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		if (rates[i] == rate)
+			return true;
+	}
+	return false;
+}
+
+/* Answers a control request. Returns the length of the IN data, 0 to ack an
+ * OUT request (its data is already read into data) or -1 to stall.
+ */
+static int gadget_control(const struct usb_ctrlrequest *ctrl, u8 *data)
+{
+	const unsigned int value = ctrl->wValue;
+	unsigned int rate, len;
+
+	switch (ctrl->bRequestType & USB_TYPE_MASK) {
+	case USB_TYPE_STANDARD:
+		switch (ctrl->bRequest) {
+		case USB_REQ_GET_DESCRIPTOR:
+			switch (value >> 8) {
+			case USB_DT_DEVICE:
+				memcpy(data, &gadget_device_desc, sizeof(gadget_device_desc));
+				return sizeof(gadget_device_desc);
+			case USB_DT_DEVICE_QUALIFIER:
+				memcpy(data, &gadget_qualifier_desc, sizeof(gadget_qualifier_desc));
+				return sizeof(gadget_qualifier_desc);
+			case USB_DT_CONFIG:
+				return gadget_config_desc(data);
+			case USB_DT_STRING:
+				return gadget_string_desc(data, value & 0xff);
+			}
+			return -1;
+		case USB_REQ_SET_CONFIGURATION:
+			if (ioctl(gadget.fd, USB_RAW_IOCTL_VBUS_DRAW, 250) < 0 ||
+			    ioctl(gadget.fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+				perror("configuring the gadget");
+				return -1;
+			}
+			return 0;
+		case USB_REQ_SET_INTERFACE:
+			/* The endpoints stay enabled for alternate setting 0, the
+			 * driver never goes back there.
+			 */
+			if (ctrl->wIndex > 1 || value > 1)
+				return -1;
+			if (value && gadget_enable(ctrl->wIndex) < 0)
+				return -1;
+			return 0;
+		case USB_REQ_GET_INTERFACE:
+			data[0] = 1;
+			return 1;
+		case USB_REQ_CLEAR_FEATURE: /* halting the endpoints in the probe */
+			return 0;
+		}
+		return -1;
+
+	case USB_TYPE_VENDOR:
+		if (ctrl->bRequest == 0x56 && (ctrl->bRequestType & USB_DIR_IN)) {
+			/* The firmware version, zero padded up to wLength */
+			len = ctrl->wLength < GADGET_CTRL_MAX ? ctrl->wLength : GADGET_CTRL_MAX;
+			memset(data, 0, len);
+			data[0] = 0x31;
+			data[1] = 0x01;
+			data[2] = 0x08;
+			return len;
+		}
+		if (ctrl->bRequest == 0x49 && (ctrl->bRequestType & USB_DIR_IN)) {
+			data[0] = 0x32;
+			return 1;
+		}
+		if (ctrl->bRequest == 0x49)
+			return 0;
+		return -1;
+
+	case USB_TYPE_CLASS:
+		if (ctrl->bRequest == UAC_GET_CUR && (ctrl->bRequestType & USB_DIR_IN)) {
+			pthread_mutex_lock(&gadget_lock);
+			rate = gadget.rate;
+			pthread_mutex_unlock(&gadget_lock);
+			data[0] = rate;
+			data[1] = rate >> 8;
+			data[2] = rate >> 16;
+			return 3;
+		}
+		if (ctrl->bRequest == UAC_SET_CUR && !(ctrl->bRequestType & USB_DIR_IN) &&
+		    ctrl->wLength == 3) {
+			/* Like the device, an unknown rate is ignored silently */
+			rate = data[0] | (data[1] << 8) | (data[2] << 16);
+			if (!gadget_rate_valid(rate))
+				return 0;
+			pthread_mutex_lock(&gadget_lock);
+			if (gadget.rate != rate) {
+				gadget.rate = rate;
+				gadget.rate_gen++;
+			}
+			pthread_mutex_unlock(&gadget_lock);
+			return 0;
+		}
+		return -1;
+	}
+	return -1;
+}
+
+static void gadget_report(FILE *out, double elapsed, const struct gadget_stats *now,
+			  const struct gadget_stats *last, double interval)
+{
+	unsigned int rate, gen;
+
+	rate = gadget_rate(&gen);
+	fprintf(out, "{\"time\": %.1f, \"rate\": %u, \"out_mb_s\": %.3f, \"out_frames_s\": %.0f, "
+		"\"in_mb_s\": %.3f, \"out_bytes\": %llu, \"in_bytes\": %llu, \"underruns\": %llu, "
+		"\"restarts\": %llu, \"late_max_us\": %llu, \"overruns\": %llu, \"format_errors\": %llu, "
+		"\"silent_frames\": %llu, \"pattern_frames\": %llu, \"pattern_errors\": %llu, "
+		"\"discontinuities\": %llu}\n",
+		elapsed, rate,
+		(now->out_bytes - last->out_bytes) / interval / 1e6,
+		(now->out_blocks - last->out_blocks) * PCM_BLOCK_FRAMES / interval,
+		(now->in_bytes - last->in_bytes) / interval / 1e6,
+		(unsigned long long)now->out_bytes, (unsigned long long)now->in_bytes,
+		(unsigned long long)now->underruns, (unsigned long long)now->restarts,
+		(unsigned long long)now->late_max_ns / 1000,
+		(unsigned long long)now->overruns, (unsigned long long)now->format_errors,
+		(unsigned long long)now->silent_frames, (unsigned long long)now->pattern_frames,
+		(unsigned long long)now->pattern_errors, (unsigned long long)now->discontinuities);
+	fflush(out);
+}
+
+static void *gadget_report_thread(void *arg)
+{
+	const double interval = *(double *)arg;
+	const uint64_t start = gadget_now();
+	struct gadget_stats last = { 0 }, now;
+	uint64_t next = start;
+
+	while (!gadget_stop) {
+		next += interval * 1e9;
+		gadget_sleep_until(next);
+
+		pthread_mutex_lock(&gadget_lock);
+		now = gadget.stats;
+		pthread_mutex_unlock(&gadget_lock);
+
+		gadget_report(stdout, (next - start) / 1e9, &now, &last, interval);
+		last = now;
+	}
+	return NULL;
+}
+
+/* Writes frames of the test pattern as raw s24_3le to stdout, for aplay */
+static int gadget_write_pattern(unsigned long numFrames)
+{
+	unsigned long n;
+	u8 frame[6];
+
+	for (n = 0; n < numFrames; n++) {
+		const uint32_t left = PATTERN_LEFT(n);
+		const uint32_t right = PATTERN_RIGHT(n);
+
+		frame[0] = left;
+		frame[1] = left >> 8;
+		frame[2] = left >> 16;
+		frame[3] = right;
+		frame[4] = right >> 8;
+		frame[5] = right >> 16;
+		if (fwrite(frame, sizeof(frame), 1, stdout) != 1)
+			return 1;
+	}
+	return fflush(stdout) ? 1 : 0;
+}
+
+static void gadget_signal(int sig)
+{
+	gadget_stop = 1;
+}
+
+static void gadget_usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d udc driver] [-u udc device] [-f fifo blocks] [-i report seconds]\n"
+		"       [-p] [-o dump.raw]\n"
+		"       %s -g frames > pattern.raw\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+	struct {
+		struct usb_raw_event inner;
+		struct usb_ctrlrequest ctrl;
+		u8 data[GADGET_CTRL_MAX];
+	} event;
+	struct {
+		struct usb_raw_ep_io inner;
+		u8 data[GADGET_CTRL_MAX];
+	} io;
+	struct usb_raw_init init = { .speed = USB_SPEED_HIGH };
+	const char *driver = "dummy_udc";
+	const char *device = "dummy_udc.0";
+	double interval = 1.0;
+	struct sigaction action = { .sa_handler = gadget_signal };
+	pthread_t reporter;
+	const struct gadget_stats zero = { 0 };
+	struct gadget_stats stats;
+	uint64_t start;
+	double elapsed;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:u:f:i:po:g:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			driver = optarg;
+			break;
+		case 'u':
+			device = optarg;
+			break;
+		case 'f':
+			gadget.fifo_blocks = atoi(optarg);
+			break;
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'p':
+			gadget.check_pattern = true;
+			break;
+		case 'o':
+			gadget.dump = fopen(optarg, "wb");
+			if (!gadget.dump) {
+				perror(optarg);
+				return 2;
+			}
+			break;
+		case 'g':
+			return gadget_write_pattern(strtoul(optarg, NULL, 0));
+		default:
+			gadget_usage(argv[0]);
+			return 2;
+		}
+	}
+	if (gadget.fifo_blocks < 1 || interval <= 0) {
+		gadget_usage(argv[0]);
+		return 2;
+	}
+
+	/* Without SA_RESTART, so the blocking ioctls return on ^C */
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	gadget.fd = open("/dev/raw-gadget", O_RDWR);
+	if (gadget.fd < 0) {
+		perror("opening /dev/raw-gadget (modprobe raw_gadget and dummy_hcd?)");
+		return 2;
+	}
+	strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+	if (ioctl(gadget.fd, USB_RAW_IOCTL_INIT, &init) < 0 ||
+	    ioctl(gadget.fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("starting the gadget");
+		return 2;
+	}
+
+	start = gadget_now();
+	pthread_create(&reporter, NULL, gadget_report_thread, &interval);
+
+	while (!gadget_stop) {
+		event.inner.type = 0;
+		event.inner.length = sizeof(event.ctrl) + sizeof(event.data);
+		if (ioctl(gadget.fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("fetching an event");
+			break;
+		}
+		if (event.inner.type != USB_RAW_EVENT_CONTROL)
+			continue;
+
+		/* The data stage of an OUT request comes first, so it can be looked at */
+		io.inner.ep = 0;
+		io.inner.flags = 0;
+		io.inner.length = 0;
+		if (!(event.ctrl.bRequestType & USB_DIR_IN) && event.ctrl.wLength) {
+			io.inner.length = event.ctrl.wLength < sizeof(io.data) ? event.ctrl.wLength : sizeof(io.data);
+			if (ioctl(gadget.fd, USB_RAW_IOCTL_EP0_READ, &io) < 0) {
+				perror("reading the control data");
+				continue;
+			}
+		}
+
+		ret = gadget_control(&event.ctrl, io.data);
+		if (ret < 0) {
+			fprintf(stderr, "stalling request 0x%02x 0x%02x value 0x%04x index 0x%04x\n",
+				event.ctrl.bRequestType, event.ctrl.bRequest, event.ctrl.wValue,
+				event.ctrl.wIndex);
+			ioctl(gadget.fd, USB_RAW_IOCTL_EP0_STALL, 0);
+		} else if (event.ctrl.bRequestType & USB_DIR_IN) {
+			io.inner.length = ret < event.ctrl.wLength ? ret : event.ctrl.wLength;
+			if (ioctl(gadget.fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+				perror("answering a control request");
+		} else if (!event.ctrl.wLength) {
+			/* The status stage */
+			if (ioctl(gadget.fd, USB_RAW_IOCTL_EP0_READ, &io) < 0)
+				perror("acking a control request");
+		}
+	}
+
+	pthread_mutex_lock(&gadget_lock);
+	stats = gadget.stats;
+	pthread_mutex_unlock(&gadget_lock);
+
+	elapsed = (gadget_now() - start) / 1e9;
+	gadget_report(stdout, elapsed, &stats, &zero, elapsed);
+	if (gadget.dump)
+		fclose(gadget.dump);
+
+	/* The endpoint threads may still block in their ioctls, exit takes them down */
+	return stats.format_errors || stats.pattern_errors ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/* The statistics of a card live in debugfs, e.g.
+ * /sys/kernel/debug/snd-usb-sinn7-card1/stats. Writing anything to the
+ * file resets them.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <sound/core.h>
+
+#include "stats.h"
+
+static void sinn7_stats_show_histogram(struct seq_file *m, const char *name,
+					const atomic_t *histogram)
+{
+	int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < SINN7_STATS_BUCKETS - 1; i++)
+		seq_printf(m, "  <%uus: %d\n", 1U << i, atomic_read(&histogram[i]));
+	seq_printf(m, "  >=%uus: %d\n", 1U << (SINN7_STATS_BUCKETS - 2),
+		   atomic_read(&histogram[SINN7_STATS_BUCKETS - 1]));
+}
+
+static int sinn7_stats_show(struct seq_file *m, void *v)
+{
+	struct sinn7_stats *stats = m->private;
+	const long encodes = atomic_long_read(&stats->encodes);
+	int i;
+
+	seq_printf(m, "out_submitted: %ld\n", atomic_long_read(&stats->out_submitted));
+	seq_printf(m, "out_completed: %ld\n", atomic_long_read(&stats->out_completed));
+	seq_printf(m, "in_submitted: %ld\n", atomic_long_read(&stats->in_submitted));
+	seq_printf(m, "in_completed: %ld\n", atomic_long_read(&stats->in_completed));
+	seq_printf(m, "submit_errors: %ld\n", atomic_long_read(&stats->submit_errors));
+	seq_printf(m, "urb_errors: %ld\n", atomic_long_read(&stats->urb_errors));
+	seq_printf(m, "underruns: %ld\n", atomic_long_read(&stats->underruns));
+	seq_printf(m, "drained: %ld\n", atomic_long_read(&stats->drained));
+	seq_printf(m, "in_flight: %d\n", atomic_read(stats->in_flight_now));
+	seq_printf(m, "in_flight_max: %d\n", atomic_read(&stats->in_flight_max));
+	seq_printf(m, "drift_ppb: %d\n", atomic_read(&stats->drift_ppb));
+	seq_printf(m, "encodes: %ld\n", encodes);
+	seq_printf(m, "encode_ns_avg: %ld\n",
+		   encodes ? atomic_long_read(&stats->encode_ns) / encodes : 0);
+
+	sinn7_stats_show_histogram(m, "submit_latency", stats->submit_latency);
+	sinn7_stats_show_histogram(m, "encode_time", stats->encode_time);
+	sinn7_stats_show_histogram(m, "start_latency", stats->start_latency);
+
+	seq_puts(m, "in_flight_at_submit:\n");
+	for (i = 0; i < SINN7_STATS_URBS; i++) {
+		if (atomic_read(&stats->in_flight[i]))
+			seq_printf(m, "  %d: %d\n", i, atomic_read(&stats->in_flight[i]));
+	}
+	return 0;
+}
+
+static int sinn7_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sinn7_stats_show, inode->i_private);
+}
+
+/* Any write resets the counters, the live in flight value stays */
+static ssize_t sinn7_stats_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct sinn7_stats *stats = ((struct seq_file *)file->private_data)->private;
+
+	/* The counters come first in the struct */
+	memset(stats, 0, offsetof(struct sinn7_stats, in_flight_now));
+	return count;
+}
+
+static const struct file_operations sinn7_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = sinn7_stats_open,
+	.read = seq_read,
+	.write = sinn7_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Failing to create the files only costs the statistics, so it's not an error */
+void sinn7_stats_init(struct sinn7_stats *stats, struct snd_card *card, const atomic_t *in_flight)
+{
+	char name[32];
+
+	stats->in_flight_now = in_flight;
+
+	snprintf(name, sizeof(name), "snd-usb-sinn7-card%d", card->number);
+	stats->dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(stats->dir)) {
+		stats->dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", 0600, stats->dir, stats, &sinn7_stats_fops);
+}
+
+void sinn7_stats_free(struct sinn7_stats *stats)
+{
+	debugfs_remove_recursive(stats->dir);
+	stats->dir = NULL;
+}
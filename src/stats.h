@@ -0,0 +1,87 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SINN7_STATS_H
+#define SINN7_STATS_H
+
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+struct dentry;
+struct snd_card;
+
+#define SINN7_STATS_BUCKETS 16 /* log2 of microseconds: <1us, <2us, ... >=16ms */
+#define SINN7_STATS_URBS    33 /* in flight histogram, 0 to PCM_N_URBS_MAX */
+
+/* Counters of the streaming engine, shown in debugfs (see stats.c). They are
+ * updated from the urb handlers and the timer without any lock, so each of
+ * them is exact, but a snapshot of all of them is not consistent.
+ */
+struct sinn7_stats {
+	atomic_long_t out_submitted;
+	atomic_long_t out_completed;
+	atomic_long_t in_submitted;
+	atomic_long_t in_completed;
+	atomic_long_t submit_errors;
+	atomic_long_t urb_errors; /* completions with an error (not an unlink), they stop the stream */
+	atomic_long_t underruns; /* the timer wanted to submit, but found no idle urb */
+	atomic_long_t drained; /* a running playback had no other urb in flight */
+	atomic_long_t encodes; /* urbs filled from the alsa buffer */
+	atomic_long_t encode_ns; /* their total encode time */
+	atomic_t in_flight_max;
+
+	atomic_t submit_latency[SINN7_STATS_BUCKETS]; /* timer expiry or completion to submit */
+	atomic_t encode_time[SINN7_STATS_BUCKETS]; /* per filled urb */
+	atomic_t start_latency[SINN7_STATS_BUCKETS]; /* playback TRIGGER_START to the completion of its first urb */
+	atomic_t in_flight[SINN7_STATS_URBS]; /* out urbs in flight after a submit */
+
+	/* Not reset by sinn7_stats_write, keep them behind the counters */
+	const atomic_t *in_flight_now; /* the live value of the pcm runtime */
+	atomic_t drift_ppb; /* estimate of the device clock against the host clock */
+	struct dentry *dir;
+};
+
+static inline void sinn7_stats_time(atomic_t *histogram, s64 ns)
+{
+	const s64 us = ns > 0 ? div_s64(ns, NSEC_PER_USEC) : 0;
+	unsigned int bucket = us ? fls64(us) : 0;
+
+	if (bucket >= SINN7_STATS_BUCKETS)
+		bucket = SINN7_STATS_BUCKETS - 1;
+	atomic_inc(&histogram[bucket]);
+}
+
+/* Called after each successful out submit with the new number of urbs in flight */
+static inline void sinn7_stats_in_flight(struct sinn7_stats *stats, int in_flight)
+{
+	int max = atomic_read(&stats->in_flight_max);
+
+	atomic_inc(&stats->in_flight[clamp(in_flight, 0, SINN7_STATS_URBS - 1)]);
+	while (in_flight > max) {
+		int old = atomic_cmpxchg(&stats->in_flight_max, max, in_flight);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
+void sinn7_stats_init(struct sinn7_stats *stats, struct snd_card *card, const atomic_t *in_flight);
+void sinn7_stats_free(struct sinn7_stats *stats);
+#endif /* SINN7_STATS_H */
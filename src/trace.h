@@ -0,0 +1,165 @@
+/*
+ * Linux driver for Sinn7 Status 24|96 compatible devices
+ *
+ * Copyright 2016-2017 (C) Marc Streckfuß
+ *
+ * Authors:
+ *           Marc Streckfuß <marc.streckfuss@gmail.com>
+ *
+ * The driver is based on the work done in the M2Tech hiFace Driver which
+ * in turn is based on TerraTec DMX 6Fire USB.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/* Tracepoints along the life of an urb, e.g.
+ * trace-cmd record -e snd_usb_sinn7 or perf record -e 'snd_usb_sinn7:*'.
+ * The urb events carry the direction, the urb index, the byte count and the
+ * position of the urb's data in the alsa buffer (dma_off, in bytes), so an
+ * urb can be followed from its fill over the submit to its completion.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snd_usb_sinn7
+
+#if !defined(SINN7_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SINN7_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(sinn7_urb,
+	TP_PROTO(bool out, unsigned int index, unsigned int bytes, unsigned long dma_off),
+	TP_ARGS(out, index, bytes, dma_off),
+
+	TP_STRUCT__entry(
+		__field(bool, out)
+		__field(unsigned int, index)
+		__field(unsigned int, bytes)
+		__field(unsigned long, dma_off)
+	),
+
+	TP_fast_assign(
+		__entry->out = out;
+		__entry->index = index;
+		__entry->bytes = bytes;
+		__entry->dma_off = dma_off;
+	),
+
+	TP_printk("%s urb=%u bytes=%u dma_off=%lu", __entry->out ? "out" : "in",
+		  __entry->index, __entry->bytes, __entry->dma_off)
+);
+
+/* An out urb is filled from the alsa buffer (not for silence) */
+DEFINE_EVENT(sinn7_urb, sinn7_urb_fill,
+	TP_PROTO(bool out, unsigned int index, unsigned int bytes, unsigned long dma_off),
+	TP_ARGS(out, index, bytes, dma_off)
+);
+
+/* Around the conversion, bytes are the pcm bytes */
+DEFINE_EVENT(sinn7_urb, sinn7_encode_start,
+	TP_PROTO(bool out, unsigned int index, unsigned int bytes, unsigned long dma_off),
+	TP_ARGS(out, index, bytes, dma_off)
+);
+
+DEFINE_EVENT(sinn7_urb, sinn7_encode_end,
+	TP_PROTO(bool out, unsigned int index, unsigned int bytes, unsigned long dma_off),
+	TP_ARGS(out, index, bytes, dma_off)
+);
+
+/* Right before usb_submit_urb, bytes is the transfer length */
+DEFINE_EVENT(sinn7_urb, sinn7_urb_submit,
+	TP_PROTO(bool out, unsigned int index, unsigned int bytes, unsigned long dma_off),
+	TP_ARGS(out, index, bytes, dma_off)
+);
+
+/* In the completion handler, bytes is the actual length */
+DEFINE_EVENT(sinn7_urb, sinn7_urb_complete,
+	TP_PROTO(bool out, unsigned int index, unsigned int bytes, unsigned long dma_off),
+	TP_ARGS(out, index, bytes, dma_off)
+);
+
+TRACE_EVENT(sinn7_period_elapsed,
+	TP_PROTO(bool out, unsigned long dma_off),
+	TP_ARGS(out, dma_off),
+
+	TP_STRUCT__entry(
+		__field(bool, out)
+		__field(unsigned long, dma_off)
+	),
+
+	TP_fast_assign(
+		__entry->out = out;
+		__entry->dma_off = dma_off;
+	),
+
+	TP_printk("%s dma_off=%lu", __entry->out ? "playback" : "capture", __entry->dma_off)
+);
+
+/* The values of the STREAM_XXX enum in pcm.c */
+TRACE_EVENT(sinn7_stream_state,
+	TP_PROTO(int card, u8 state),
+	TP_ARGS(card, state),
+
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(u8, state)
+	),
+
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->state = state;
+	),
+
+	TP_printk("card=%d state=%s", __entry->card,
+		  __print_symbolic(__entry->state,
+				   { 0, "DISABLED" },
+				   { 1, "STARTING" },
+				   { 2, "RUNNING" },
+				   { 3, "STOPPING" }))
+);
+
+/* The playback got its TRIGGER_START */
+TRACE_EVENT(sinn7_start,
+	TP_PROTO(int card),
+	TP_ARGS(card),
+
+	TP_STRUCT__entry(
+		__field(int, card)
+	),
+
+	TP_fast_assign(
+		__entry->card = card;
+	),
+
+	TP_printk("card=%d", __entry->card)
+);
+
+/* The urb with the first frames after the TRIGGER_START completed */
+TRACE_EVENT(sinn7_start_done,
+	TP_PROTO(int card, s64 latency_ns),
+	TP_ARGS(card, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(s64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("card=%d latency_ns=%lld", __entry->card, __entry->latency_ns)
+);
+
+#endif /* SINN7_TRACE_H */
+
+/* The module is built out of tree, so the header is found relative to it */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>